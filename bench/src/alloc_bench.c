@@ -0,0 +1,74 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "gc.h"
+
+#define SLOTS 256
+
+static unsigned ops;
+static pthread_barrier_t start;
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// Allocation churn with a small working set, so that the caches keep
+// recycling their own cells.
+static void *worker(void *arg)
+{
+    (void)arg;
+    void *slots[SLOTS] = {0};
+    pthread_barrier_wait(&start);
+    for (unsigned i = 0; i < ops; i++)
+    {
+        unsigned slot = i % SLOTS;
+        if (slots[slot] != NULL)
+        {
+            gc_free(slots[slot]);
+        }
+        slots[slot] = gc_malloc(16 + (i % 8) * 16);
+    }
+    for (unsigned i = 0; i < SLOTS; i++)
+    {
+        gc_free(slots[i]);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    ops = argc > 1 ? atoi(argv[1]) : 1000000;
+    unsigned max_threads = argc > 2 ? atoi(argv[2]) : 64;
+
+    gc_create();
+    gc_pause();
+
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+    {
+        pthread_t *tids = malloc(threads * sizeof(pthread_t));
+        pthread_barrier_init(&start, NULL, threads + 1);
+        for (unsigned t = 0; t < threads; t++)
+        {
+            pthread_create(&tids[t], NULL, worker, NULL);
+        }
+        pthread_barrier_wait(&start);
+        double t0 = now_ms();
+        for (unsigned t = 0; t < threads; t++)
+        {
+            pthread_join(tids[t], NULL);
+        }
+        double elapsed = now_ms() - t0;
+        pthread_barrier_destroy(&start);
+        free(tids);
+
+        printf("alloc_bench threads=%u ops=%u total_ms=%.3f mops_per_sec=%.2f\n", threads, ops, elapsed, threads * (double)ops / elapsed / 1e3);
+    }
+
+    gc_resume();
+    gc_destruct();
+    return 0;
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "alloc_trace.h"
+#include "bench.h"
+
+// Ids stay below the peak number of objects alive at once, so a larger one
+// means a corrupt trace rather than a table worth gigabytes.
+#define MAX_ID ((uint64_t)1 << 28)
+
+// Objects by trace id. The table is itself a collected object, reachable
+// from here, so the objects the trace has not seen die stay alive.
+static void **objects;
+static size_t capacity;
+
+static int reserve(uint64_t id)
+{
+    if (id < capacity)
+    {
+        return 1;
+    }
+    size_t new_capacity = capacity ? 2 * capacity : 1024;
+    while (new_capacity <= id)
+    {
+        new_capacity *= 2;
+    }
+    void **table = gc_realloc(objects, new_capacity * sizeof(void *));
+    if (table == NULL)
+    {
+        return 0;
+    }
+    memset(table + capacity, 0, (new_capacity - capacity) * sizeof(void *));
+    objects = table;
+    capacity = new_capacity;
+    return 1;
+}
+
+// The traced program is taken to initialise what it allocates, which also
+// keeps stale free-list links from being mistaken for pointers.
+static void *allocate(const struct AllocEvent *event)
+{
+    int atomic = event->variant == GC_KIND_POINTER_FREE;
+    if (event->type == GC_EVENT_CALLOC)
+    {
+        return atomic ? gc_calloc_atomic(1, event->size) : gc_calloc(1, event->size);
+    }
+    void *ptr = atomic ? gc_malloc_atomic(event->size) : gc_malloc(event->size);
+    if (ptr != NULL)
+    {
+        memset(ptr, 0, event->size);
+    }
+    return ptr;
+}
+
+// Replays a trace written by set_allocation_trace() in one thread, in the
+// recorded order and as fast as possible. Object contents are not traced:
+// every object is kept alive by the table until its recorded free or death,
+// so the heap has the recorded shape over time but no pointers inside it.
+// Typed allocations are replayed as plain ones. The collector's settings
+// can be changed for an A/B comparison by the optional arguments.
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: %s TRACE [heap growth percent] [marker threads]\n", argv[0]);
+        return 2;
+    }
+    FILE *stream = fopen(argv[1], "rb");
+    if (stream == NULL)
+    {
+        perror("alloc_replay: cannot open the trace");
+        return 1;
+    }
+    if (!alloc_trace_read_header(stream))
+    {
+        fprintf(stderr, "alloc_replay: %s is not an allocation trace\n", argv[1]);
+        return 1;
+    }
+
+    gc_create();
+    if (argc > 2)
+    {
+        set_heap_growth(atoi(argv[2]));
+    }
+    if (argc > 3)
+    {
+        set_marker_threads(atoi(argv[3]));
+    }
+
+    unsigned long counts[GC_EVENT_COLLECT + 1] = {0};
+    unsigned long traced_ns = 0;
+    struct AllocEvent event;
+    int status = 0;
+    double t0 = now_ms();
+    while (status == 0 && alloc_trace_read_event(stream, &event))
+    {
+        counts[event.type]++;
+        traced_ns += event.delta_ns;
+        if (event.type == GC_EVENT_COLLECT)
+        {
+            if (event.variant == GC_TRACE_COLLECT_MINOR)
+            {
+                collect_garbage_minor();
+            }
+            else if (event.variant == GC_TRACE_COLLECT_MAJOR)
+            {
+                collect_garbage_major();
+            }
+            else
+            {
+                collect_garbage();
+            }
+            continue;
+        }
+
+        if (event.id >= MAX_ID)
+        {
+            fprintf(stderr, "alloc_replay: object id %llu is out of range, the trace is corrupt\n", (unsigned long long)event.id);
+            status = 1;
+            break;
+        }
+        if (!reserve(event.id))
+        {
+            fprintf(stderr, "alloc_replay: out of memory for object id %llu\n", (unsigned long long)event.id);
+            status = 1;
+            break;
+        }
+        void *ptr;
+        switch (event.type)
+        {
+        case GC_EVENT_MALLOC:
+        case GC_EVENT_CALLOC:
+        case GC_EVENT_REALLOC:
+            ptr = event.type == GC_EVENT_REALLOC ? gc_realloc(objects[event.id], event.size) : allocate(&event);
+            if (ptr == NULL)
+            {
+                fprintf(stderr, "alloc_replay: out of memory replaying %zu bytes\n", event.size);
+                status = 1;
+                break;
+            }
+            objects[event.id] = ptr;
+            break;
+        case GC_EVENT_FREE:
+            if (objects[event.id] != NULL)
+            {
+                gc_free(objects[event.id]);
+            }
+            objects[event.id] = NULL;
+            break;
+        case GC_EVENT_DEATH:
+            objects[event.id] = NULL;
+            break;
+        default:
+            break;
+        }
+    }
+    double elapsed = now_ms() - t0;
+    fclose(stream);
+    if (status != 0)
+    {
+        objects = NULL;
+        gc_destruct();
+        return status;
+    }
+
+    printf("alloc_replay allocations=%lu reallocs=%lu frees=%lu deaths=%lu collects=%lu traced_ms=%.3f total_ms=%.3f live_bytes=%zu",
+           counts[GC_EVENT_MALLOC] + counts[GC_EVENT_CALLOC], counts[GC_EVENT_REALLOC], counts[GC_EVENT_FREE],
+           counts[GC_EVENT_DEATH], counts[GC_EVENT_COLLECT], traced_ns / 1e6, elapsed, get_live_bytes());
+    print_pauses();
+    printf("\n");
+
+    objects = NULL;
+    gc_destruct();
+    return 0;
+}
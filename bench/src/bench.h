@@ -0,0 +1,70 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "gc.h"
+
+// Helpers shared by the benchmarks. Every benchmark prints one line per
+// run: its name followed by key=value pairs, times in milliseconds unless
+// the key says otherwise. Workloads draw from a fixed-seed generator, so a
+// run with the same arguments allocates the same sequence.
+
+static inline double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+// xorshift64*
+static inline uint64_t bench_random(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static inline uint64_t bench_seed(unsigned stream)
+{
+    return 0x9E3779B97F4A7C15ULL * (stream + 1);
+}
+
+// Pause percentiles come from the power-of-two histogram of the
+// statistics, so p50 and p99 are the upper bounds of their buckets;
+// max is exact.
+static inline unsigned long pause_percentile_us(const unsigned long *histogram, unsigned long cycles, unsigned percent)
+{
+    unsigned long rank = (cycles * percent + 99) / 100;
+    unsigned long seen = 0;
+    for (unsigned i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        seen += histogram[i];
+        if (seen >= rank && histogram[i] != 0)
+        {
+            return 1UL << i;
+        }
+    }
+    return 1UL << (GC_PAUSE_BUCKETS - 1);
+}
+
+// Prints the collections of the current collector, which is why runs that
+// report pauses create a collector of their own.
+static inline void print_pauses()
+{
+    struct GcStats stats;
+    gc_get_stats(&stats);
+    printf(" collections=%lu pause_total_ms=%.3f", stats.cycles, stats.total.pause_ns / 1e6);
+    if (stats.cycles != 0)
+    {
+        printf(" pause_p50_us=%lu pause_p99_us=%lu pause_max_us=%.1f",
+               pause_percentile_us(stats.pause_histogram, stats.cycles, 50),
+               pause_percentile_us(stats.pause_histogram, stats.cycles, 99), stats.max_pause_ns / 1e3);
+    }
+}
+
+#endif // BENCH_H
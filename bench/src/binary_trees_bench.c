@@ -0,0 +1,93 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+
+#define MIN_DEPTH 4
+
+struct node
+{
+    struct node *left;
+    struct node *right;
+};
+
+static int max_depth;
+static unsigned thread_cnt;
+static pthread_barrier_t start;
+static long checks;
+
+static struct node *build(int depth)
+{
+    struct node *n = gc_malloc(sizeof(struct node));
+    n->left = depth > 0 ? build(depth - 1) : NULL;
+    n->right = depth > 0 ? build(depth - 1) : NULL;
+    return n;
+}
+
+static long check(const struct node *n)
+{
+    return n->left == NULL ? 1 : 1 + check(n->left) + check(n->right);
+}
+
+// The binary-trees workload: many short-lived trees of growing depth next
+// to one tree that lives for the whole run. Every thread builds its share
+// of the short-lived trees.
+static void *worker(void *arg)
+{
+    unsigned id = (unsigned)(long)arg;
+    gc_register_thread();
+    pthread_barrier_wait(&start);
+    long sum = 0;
+    for (int depth = MIN_DEPTH; depth <= max_depth; depth += 2)
+    {
+        long iterations = 1L << (max_depth - depth + MIN_DEPTH);
+        for (long i = id; i < iterations; i += thread_cnt)
+        {
+            sum += check(build(depth));
+        }
+    }
+    __atomic_fetch_add(&checks, sum, __ATOMIC_RELAXED);
+    gc_unregister_thread();
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    max_depth = argc > 1 ? atoi(argv[1]) : 16;
+    unsigned max_threads = argc > 2 ? atoi(argv[2]) : 8;
+
+    for (thread_cnt = 1; thread_cnt <= max_threads; thread_cnt *= 2)
+    {
+        gc_create();
+        struct node *volatile long_lived = build(max_depth);
+        checks = 0;
+
+        pthread_t *tids = malloc(thread_cnt * sizeof(pthread_t));
+        pthread_barrier_init(&start, NULL, thread_cnt + 1);
+        for (unsigned t = 0; t < thread_cnt; t++)
+        {
+            pthread_create(&tids[t], NULL, worker, (void *)(long)t);
+        }
+        // the main thread only waits, in a blocking region so that the
+        // collector does not have to stop it
+        gc_enter_blocking();
+        pthread_barrier_wait(&start);
+        double t0 = now_ms();
+        for (unsigned t = 0; t < thread_cnt; t++)
+        {
+            pthread_join(tids[t], NULL);
+        }
+        double elapsed = now_ms() - t0;
+        gc_leave_blocking();
+        pthread_barrier_destroy(&start);
+        free(tids);
+
+        printf("binary_trees_bench depth=%d threads=%u checks=%ld long_lived=%ld total_ms=%.3f", max_depth, thread_cnt, checks, check(long_lived), elapsed);
+        print_pauses();
+        printf("\n");
+
+        long_lived = NULL;
+        gc_destruct();
+    }
+    return 0;
+}
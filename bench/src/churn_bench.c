@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+#define SLOTS 1024
+
+static void *slots[SLOTS];
+
+static void report(const char *op, unsigned ops, double elapsed)
+{
+    printf("churn_bench op=%s ops=%u total_ms=%.3f mops_per_sec=%.2f\n", op, ops, elapsed, ops / elapsed / 1e3);
+}
+
+static void replace_slot(unsigned slot, void *ptr)
+{
+    if (slots[slot] != NULL)
+    {
+        gc_free(slots[slot]);
+    }
+    slots[slot] = ptr;
+}
+
+static void release_slots()
+{
+    for (unsigned i = 0; i < SLOTS; i++)
+    {
+        if (slots[i] != NULL)
+        {
+            gc_free(slots[i]);
+            slots[i] = NULL;
+        }
+    }
+}
+
+// Explicit frees into a working set of SLOTS objects of random small sizes.
+static void malloc_free(unsigned ops)
+{
+    uint64_t rng = bench_seed(0);
+    double t0 = now_ms();
+    for (unsigned i = 0; i < ops; i++)
+    {
+        uint64_t r = bench_random(&rng);
+        unsigned slot = r % SLOTS;
+        replace_slot(slot, gc_malloc(16 + (r >> 32) % 240));
+    }
+    report("malloc_free", ops, now_ms() - t0);
+    release_slots();
+}
+
+static void calloc_free(unsigned ops)
+{
+    uint64_t rng = bench_seed(1);
+    double t0 = now_ms();
+    for (unsigned i = 0; i < ops; i++)
+    {
+        uint64_t r = bench_random(&rng);
+        unsigned slot = r % SLOTS;
+        replace_slot(slot, gc_calloc(1 + (r >> 32) % 30, sizeof(void *)));
+    }
+    report("calloc_free", ops, now_ms() - t0);
+    release_slots();
+}
+
+// Buffers grown a step at a time, crossing size classes and, near the
+// end, the large object path, like a vector being appended to.
+static void realloc_grow(unsigned ops)
+{
+    uint64_t rng = bench_seed(2);
+    double t0 = now_ms();
+    for (unsigned i = 0; i < ops; i++)
+    {
+        uint64_t r = bench_random(&rng);
+        unsigned slot = r % SLOTS;
+        if (slots[slot] != NULL && *(size_t *)slots[slot] >= 8192)
+        {
+            replace_slot(slot, NULL);
+        }
+        size_t size = (slots[slot] == NULL ? 0 : *(size_t *)slots[slot]) + 16 + (r >> 32) % 128;
+        slots[slot] = gc_realloc(slots[slot], size);
+        *(size_t *)slots[slot] = size;
+    }
+    report("realloc_grow", ops, now_ms() - t0);
+    release_slots();
+}
+
+int main(int argc, char **argv)
+{
+    unsigned ops = argc > 1 ? atoi(argv[1]) : 2000000;
+
+    gc_create();
+    gc_pause();
+    malloc_free(ops);
+    calloc_free(ops);
+    realloc_grow(ops);
+    gc_resume();
+    gc_destruct();
+    return 0;
+}
@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+#include "hashmap.h"
+
+static void report(const char *op, unsigned keys, double elapsed)
+{
+    printf("hashmap_bench op=%s keys=%u total_ms=%.3f mops_per_sec=%.2f\n", op, keys, elapsed, keys / elapsed / 1e3);
+}
+
+// Keys are addresses of heap objects, as in the collector's own maps, and
+// are looked up in a shuffled order.
+int main(int argc, char **argv)
+{
+    unsigned keys = argc > 1 ? atoi(argv[1]) : 1000000;
+
+    gc_create();
+    gc_pause();
+    void **objects = malloc(keys * sizeof(void *));
+    for (unsigned i = 0; i < keys; i++)
+    {
+        objects[i] = gc_malloc(16);
+    }
+    uint64_t rng = bench_seed(0);
+    for (unsigned i = keys - 1; i > 0; i--)
+    {
+        unsigned j = bench_random(&rng) % (i + 1);
+        void *tmp = objects[i];
+        objects[i] = objects[j];
+        objects[j] = tmp;
+    }
+
+    struct HashMap *map = hashmap_create(sizeof(void *), sizeof(unsigned), hash_for_pointer);
+    double t0 = now_ms();
+    for (unsigned i = 0; i < keys; i++)
+    {
+        hashmap_insert(map, &objects[i], &i);
+    }
+    report("insert", keys, now_ms() - t0);
+
+    unsigned found = 0;
+    t0 = now_ms();
+    for (unsigned i = 0; i < keys; i++)
+    {
+        struct Iterator it = hashmap_find(map, &objects[keys - 1 - i]);
+        found += hashmap_not_end(it);
+        allow_writing(it);
+    }
+    report("find_hit", keys, now_ms() - t0);
+
+    t0 = now_ms();
+    for (unsigned i = 0; i < keys; i++)
+    {
+        void *missing = (char *)objects[i] + 8;
+        found += hashmap_contains(map, &missing);
+    }
+    report("find_miss", keys, now_ms() - t0);
+
+    t0 = now_ms();
+    for (unsigned i = 0; i < keys; i++)
+    {
+        hashmap_erase(map, &objects[i]);
+    }
+    report("erase", keys, now_ms() - t0);
+
+    if (found != keys || map->size != 0)
+    {
+        fprintf(stderr, "hashmap_bench: found %u of %u keys, %u left\n", found, keys, map->size);
+        return 1;
+    }
+    hashmap_destruct(map);
+    free(map);
+    free(objects);
+    gc_resume();
+    gc_destruct();
+    return 0;
+}
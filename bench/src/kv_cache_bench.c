@@ -0,0 +1,115 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+
+#define ENTRIES (1 << 16)
+#define LINKS 4
+
+// An entry links to random other entries, so the live heap is a random
+// graph rather than a tree. A replaced entry stays alive for as long as
+// something still links to it, but drops its own links, which keeps the
+// retained part bounded.
+struct entry
+{
+    struct entry *links[LINKS];
+    uint64_t key;
+    size_t value_size;
+    char *value;
+};
+
+static struct entry *table[ENTRIES];
+static unsigned ops;
+static unsigned write_percent;
+static pthread_barrier_t start;
+static unsigned long hits;
+
+static struct entry *make_entry(uint64_t key, uint64_t *rng)
+{
+    struct entry *e = gc_malloc(sizeof(struct entry));
+    for (unsigned i = 0; i < LINKS; i++)
+    {
+        e->links[i] = __atomic_load_n(&table[bench_random(rng) % ENTRIES], __ATOMIC_ACQUIRE);
+    }
+    e->key = key;
+    e->value_size = 16 + bench_random(rng) % 496;
+    e->value = gc_malloc_atomic(e->value_size);
+    memset(e->value, (int)key, e->value_size);
+    return e;
+}
+
+static void *worker(void *arg)
+{
+    uint64_t rng = bench_seed((unsigned)(long)arg);
+    gc_register_thread();
+    pthread_barrier_wait(&start);
+    unsigned long found = 0;
+    for (unsigned i = 0; i < ops; i++)
+    {
+        uint64_t r = bench_random(&rng);
+        uint64_t key = r % ENTRIES;
+        if ((r >> 32) % 100 < write_percent)
+        {
+            struct entry *old = __atomic_exchange_n(&table[key], make_entry(key, &rng), __ATOMIC_ACQ_REL);
+            for (unsigned l = 0; l < LINKS; l++)
+            {
+                __atomic_store_n(&old->links[l], NULL, __ATOMIC_RELAXED);
+            }
+            continue;
+        }
+        // a lookup also follows one link, as a read of related data would
+        struct entry *e = __atomic_load_n(&table[key], __ATOMIC_ACQUIRE);
+        struct entry *linked = __atomic_load_n(&e->links[(r >> 40) % LINKS], __ATOMIC_RELAXED);
+        found += e->value[e->value_size - 1] == (char)key;
+        found += linked != NULL && linked->value[0] == (char)linked->key;
+    }
+    __atomic_fetch_add(&hits, found, __ATOMIC_RELAXED);
+    gc_unregister_thread();
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    ops = argc > 1 ? atoi(argv[1]) : 1000000;
+    unsigned max_threads = argc > 2 ? atoi(argv[2]) : 8;
+    write_percent = argc > 3 ? atoi(argv[3]) : 20;
+
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+    {
+        gc_create();
+        uint64_t rng = bench_seed(max_threads);
+        for (unsigned i = 0; i < ENTRIES; i++)
+        {
+            table[i] = make_entry(i, &rng);
+        }
+        hits = 0;
+
+        pthread_t *tids = malloc(threads * sizeof(pthread_t));
+        pthread_barrier_init(&start, NULL, threads + 1);
+        for (unsigned t = 0; t < threads; t++)
+        {
+            pthread_create(&tids[t], NULL, worker, (void *)(long)t);
+        }
+        gc_enter_blocking();
+        pthread_barrier_wait(&start);
+        double t0 = now_ms();
+        for (unsigned t = 0; t < threads; t++)
+        {
+            pthread_join(tids[t], NULL);
+        }
+        double elapsed = now_ms() - t0;
+        gc_leave_blocking();
+        pthread_barrier_destroy(&start);
+        free(tids);
+
+        printf("kv_cache_bench entries=%u threads=%u ops=%u write_percent=%u hits=%lu live_bytes=%zu total_ms=%.3f mops_per_sec=%.2f",
+               ENTRIES, threads, ops, write_percent, hits, get_live_bytes(), elapsed, threads * (double)ops / elapsed / 1e3);
+        print_pauses();
+        printf("\n");
+
+        memset(table, 0, sizeof(table));
+        gc_destruct();
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "bench.h"
+
+struct node
+{
+    struct node *next;
+    long val;
+};
+
+static struct node *build(long length)
+{
+    struct node *head = NULL;
+    for (long i = 0; i < length; i++)
+    {
+        struct node *n = gc_malloc(sizeof(struct node));
+        n->next = head;
+        n->val = i;
+        head = n;
+    }
+    return head;
+}
+
+static long sum(const struct node *n)
+{
+    long total = 0;
+    for (; n != NULL; n = n->next)
+    {
+        total += n->val;
+    }
+    return total;
+}
+
+// A long list that stays alive, so every collection traces a chain as
+// deep as the list, while shorter lists are built and dropped around it.
+int main(int argc, char **argv)
+{
+    long length = argc > 1 ? atol(argv[1]) : 1000000;
+    unsigned rounds = argc > 2 ? atoi(argv[2]) : 50;
+
+    gc_create();
+    double t0 = now_ms();
+    struct node *volatile kept = build(length);
+    double build_ms = now_ms() - t0;
+
+    t0 = now_ms();
+    collect_garbage();
+    double collect_ms = now_ms() - t0;
+
+    long total = 0;
+    t0 = now_ms();
+    for (unsigned i = 0; i < rounds; i++)
+    {
+        total += sum(build(length / 10));
+    }
+    double churn_ms = now_ms() - t0;
+
+    printf("list_bench length=%ld rounds=%u build_ms=%.3f collect_ms=%.3f churn_ms=%.3f kept_sum=%ld churn_sum=%ld",
+           length, rounds, build_ms, collect_ms, churn_ms, sum(kept), total);
+    print_pauses();
+    printf("\n");
+
+    kept = NULL;
+    gc_destruct();
+    return 0;
+}
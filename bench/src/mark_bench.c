@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "gc.h"
+
+struct node
+{
+    struct node *left;
+    struct node *right;
+};
+
+struct node *root;
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static struct node *build(int depth)
+{
+    struct node *n = gc_malloc(sizeof(struct node));
+    n->left = depth > 0 ? build(depth - 1) : NULL;
+    n->right = depth > 0 ? build(depth - 1) : NULL;
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    int depth = argc > 1 ? atoi(argv[1]) : 20;
+    unsigned max_threads = argc > 2 ? atoi(argv[2]) : 8;
+
+    gc_create();
+    gc_pause();
+    root = build(depth);
+
+    for (unsigned threads = 1; threads <= max_threads; threads *= 2)
+    {
+        set_marker_threads(threads);
+        collect_garbage();
+        double t0 = now_ms();
+        collect_garbage();
+        double elapsed = now_ms() - t0;
+        printf("mark_bench depth=%d objects=%d threads=%u collect_ms=%.3f\n", depth, get_alive_allocations(), threads, elapsed);
+    }
+
+    root = NULL;
+    gc_destruct();
+    return 0;
+}
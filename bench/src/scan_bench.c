@@ -0,0 +1,170 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "gc.h"
+#include "global.h"
+
+#define STACK_SIZE (8 << 20)
+#define FRAME_SIZE (7 << 20)
+#define OBJECT_CNT 20000
+
+static void *objects[OBJECT_CNT];
+static struct HashMap *legacy_index;
+static size_t hits;
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void legacy_loop(void *start, void *end)
+{
+    for (void *i = start; i <= end - sizeof(void *); i += 1)
+    {
+        void *ptr = *(void **)i;
+        if (hashmap_contains(legacy_index, &ptr))
+        {
+            struct Iterator it = hashmap_find(legacy_index, &ptr);
+            allow_writing(it);
+            hits++;
+        }
+    }
+}
+
+static void count_hit(void *ptr, void *ctx)
+{
+    (void)ctx;
+    struct Block *block;
+    unsigned index;
+    if (heap_resolve(&gc->heap, ptr, &block, &index))
+    {
+        hits++;
+    }
+}
+
+#define BATCH 32
+
+struct Batch
+{
+    unsigned cnt;
+    void *ptrs[BATCH];
+};
+
+static void flush_batch(struct Batch *batch)
+{
+    struct Block *blocks[BATCH];
+    unsigned indices[BATCH];
+    hits += heap_resolve_many(&gc->heap, batch->ptrs, batch->cnt, blocks, indices);
+    batch->cnt = 0;
+}
+
+static void queue_hit(void *ptr, void *ctx)
+{
+    struct Batch *batch = ctx;
+    batch->ptrs[batch->cnt++] = ptr;
+    if (batch->cnt == BATCH)
+    {
+        flush_batch(batch);
+    }
+}
+
+static void batched_loop(void *start, void *end)
+{
+    struct ScanRange range;
+    range.low = gc->heap.low;
+    range.high = gc->heap.high;
+    range.unaligned = 0;
+    struct Batch batch;
+    batch.cnt = 0;
+    scan_words(start, end, &range, queue_hit, &batch);
+    flush_batch(&batch);
+}
+
+static void kernel_loop(void *start, void *end, int unaligned)
+{
+    struct ScanRange range;
+    range.low = gc->heap.low;
+    range.high = gc->heap.high;
+    range.unaligned = unaligned;
+    scan_words(start, end, &range, count_hit, NULL);
+}
+
+static void *run(void *arg)
+{
+    (void)arg;
+    volatile uintptr_t frame[FRAME_SIZE / sizeof(uintptr_t)];
+    size_t words = FRAME_SIZE / sizeof(uintptr_t);
+
+    srand(42);
+    for (size_t i = 0; i < words; i++)
+    {
+        if (rand() % 100 == 0)
+        {
+            frame[i] = (uintptr_t)objects[rand() % OBJECT_CNT];
+        }
+        else
+        {
+            frame[i] = ((uintptr_t)rand() << 31) ^ (uintptr_t)rand();
+        }
+    }
+
+    void *start = (void *)frame;
+    void *end = (void *)(frame + words);
+
+    hits = 0;
+    double t0 = now_ms();
+    legacy_loop(start, end);
+    double legacy = now_ms() - t0;
+    size_t legacy_hits = hits;
+
+    hits = 0;
+    t0 = now_ms();
+    kernel_loop(start, end, 0);
+    double aligned = now_ms() - t0;
+    size_t aligned_hits = hits;
+
+    hits = 0;
+    t0 = now_ms();
+    batched_loop(start, end);
+    double batched = now_ms() - t0;
+
+    hits = 0;
+    t0 = now_ms();
+    kernel_loop(start, end, 1);
+    double unaligned = now_ms() - t0;
+
+    printf("scan_bench kernel=%s bytes=%d legacy_ms=%.3f aligned_ms=%.3f batched_ms=%.3f unaligned_ms=%.3f "
+           "legacy_hits=%zu aligned_hits=%zu speedup=%.1f\n",
+           scan_kernel_name(), FRAME_SIZE, legacy, aligned, batched, unaligned, legacy_hits, aligned_hits, legacy / aligned);
+    return NULL;
+}
+
+int main()
+{
+    gc_create();
+    gc_pause();
+
+    legacy_index = hashmap_create(sizeof(void *), sizeof(void *), hash_for_pointer);
+    for (int i = 0; i < OBJECT_CNT; i++)
+    {
+        objects[i] = gc_malloc(16 + 16 * (i % 8));
+        hashmap_insert(legacy_index, &objects[i], &objects[i]);
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, STACK_SIZE);
+    pthread_t thread;
+    pthread_create(&thread, &attr, run, NULL);
+    pthread_join(thread, NULL);
+    pthread_attr_destroy(&attr);
+
+    hashmap_destruct(legacy_index);
+    gc_destruct();
+    return 0;
+}
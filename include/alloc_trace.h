@@ -0,0 +1,100 @@
+#ifndef ALLOC_TRACE_H
+#define ALLOC_TRACE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "hashmap.h"
+#include "heap.h"
+
+// Allocation trace format. A trace starts with the 8 bytes of
+// GC_ALLOC_TRACE_MAGIC, followed by events. An event is one byte holding
+// the event in its low 4 bits and the object kind or collection variant in
+// the high ones, then unsigned LEB128 varints: the recording thread, the
+// nanoseconds since the previous event, and for every event but COLLECT the
+// object id, then for MALLOC, CALLOC and REALLOC the size in bytes.
+//
+// Ids are small integers: the id of an object that was freed or died is
+// given to a later allocation, so they stay below the peak number of
+// objects alive at once. REALLOC keeps the id of the object. DEATH is
+// written after the collection in which an object was found unreachable,
+// or at the latest when its memory is handed out again.
+#define GC_ALLOC_TRACE_MAGIC "GCTRACE1"
+#define GC_TRACE_SWEEP_BATCH 256
+
+enum AllocEventType
+{
+    GC_EVENT_MALLOC,
+    GC_EVENT_CALLOC,
+    GC_EVENT_REALLOC,
+    GC_EVENT_FREE,
+    GC_EVENT_DEATH,
+    GC_EVENT_COLLECT,
+};
+
+// High bits of a COLLECT event.
+enum AllocTraceCollect
+{
+    GC_TRACE_COLLECT_DEFAULT,
+    GC_TRACE_COLLECT_MINOR,
+    GC_TRACE_COLLECT_MAJOR,
+};
+
+struct AllocEvent
+{
+    enum AllocEventType type;
+    // enum ObjectKind of an allocation, enum AllocTraceCollect of a COLLECT
+    unsigned variant;
+    unsigned thread;
+    unsigned long delta_ns;
+    uint64_t id;
+    size_t size;
+};
+
+// Recorder. Events are encoded and written to the stream as they happen,
+// under the recorder's lock, so memory use does not grow with the length
+// of the trace. Objects are found again by address through a map that
+// only holds the objects alive.
+struct AllocTrace
+{
+    FILE *stream;
+    int enabled;
+    struct HashMap *objects;
+    uint64_t *free_ids;
+    size_t free_id_cnt;
+    size_t free_id_capacity;
+    uint64_t next_id;
+    uint64_t allocations;
+    uint64_t cycle_allocations;
+    unsigned long last_ns;
+    pthread_mutex_t lock;
+};
+
+void alloc_trace_init(struct AllocTrace *trace);
+void alloc_trace_destruct(struct AllocTrace *trace);
+// Starts writing a trace to stream, or stops with NULL. Objects allocated
+// before the start are not traced.
+void alloc_trace_start(struct AllocTrace *trace, FILE *stream);
+
+void alloc_trace_allocate(struct AllocTrace *trace, enum AllocEventType type, enum ObjectKind kind, void *ptr, size_t size);
+void alloc_trace_realloc(struct AllocTrace *trace, void *old_ptr, void *new_ptr, enum ObjectKind kind, size_t size);
+void alloc_trace_free(struct AllocTrace *trace, void *ptr);
+void alloc_trace_collect(struct AllocTrace *trace, enum AllocTraceCollect variant);
+
+// Remembers how many objects had been allocated when the world stopped to
+// finish marking. Lock-free, for the stopped world.
+void alloc_trace_mark_done(struct AllocTrace *trace);
+// Writes DEATH for every object allocated before alloc_trace_mark_done()
+// that the marking left unmarked. Called after the world has restarted and
+// before the next cycle starts, while the marks are still those of the
+// cycle. The heap lock is taken for GC_TRACE_SWEEP_BATCH objects at a time
+// and events are written without it.
+void alloc_trace_sweep(struct AllocTrace *trace, struct Heap *heap);
+
+// Reads the header, returns 0 if the stream does not start with one.
+int alloc_trace_read_header(FILE *stream);
+// Reads the next event, returns 0 at the end of the stream or on a
+// truncated event.
+int alloc_trace_read_event(FILE *stream, struct AllocEvent *event);
+
+#endif // ALLOC_TRACE_H
@@ -0,0 +1,32 @@
+#ifndef DESCRIPTOR_H
+#define DESCRIPTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "scan.h"
+
+#define GC_DESCRIPTOR_WORD_BITS 64
+
+// Pointer layout of a typed object: bit i of bitmap is set when the word at
+// offset i * sizeof(void *) can hold a pointer. An object larger than size
+// is taken as an array of such elements. A descriptor is built once per
+// type and must outlive every object allocated with it.
+struct GcDescriptor
+{
+    size_t size;
+    size_t words;
+    uint64_t bitmap[];
+};
+
+// offsets are the offsetof() of the pointer fields of a size-byte type.
+struct GcDescriptor *gc_make_descriptor(size_t size, const size_t *offsets, size_t cnt);
+void gc_free_descriptor(struct GcDescriptor *descriptor);
+
+#define GC_MAKE_DESCRIPTOR(type, offsets) \
+    gc_make_descriptor(sizeof(type), (offsets), sizeof(offsets) / sizeof((offsets)[0]))
+
+// Visits the pointer words of the elements in [start, end) that pass the
+// range filter; start must be the start of an element.
+void descriptor_scan(const struct GcDescriptor *descriptor, const void *start, const void *end, const struct ScanRange *range, scan_visitor visit, void *ctx);
+
+#endif // DESCRIPTOR_H
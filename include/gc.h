@@ -4,36 +4,134 @@
 #ifdef __cplusplus
     #include <atomic>
     typedef std::atomic<int> atomic_int;
+    typedef std::atomic<size_t> atomic_size_t;
 #else
     #include <stdatomic.h>
 #endif
 #include <pthread.h>
+#include <setjmp.h>
+#include "alloc_trace.h"
+#include "descriptor.h"
 #include "hashmap.h"
+#include "heap.h"
+#include "mark.h"
 #include "memory_access.h"
+#include "parallel_mark.h"
+#include "roots.h"
+#include "soft_dirty.h"
+#include "stack_watermark.h"
+#include "stats.h"
+#include "sweeper.h"
+#include "thread_cache.h"
+#include "write_barrier.h"
+
+#define GC_MAJOR_INTERVAL 8
+#define GC_STEP_WORK 256
+#define GC_SWEEP_STEP 16
+#define GC_HEAP_GROWTH 100
+#define GC_MIN_HEAP ((size_t)4 << 20)
+#define GC_MIN_ALLOWANCE ((size_t)256 << 10)
+#define GC_MARK_SHARE 25
+#define GC_MAX_STRETCH 4
+#define GC_BYTES_BATCH ((size_t)64 << 10)
+
+enum GcPhase
+{
+    GC_PHASE_IDLE,
+    GC_PHASE_MARK,
+    GC_PHASE_SWEEP
+};
 
-unsigned hash_for_pointer(const void *value);
-unsigned hash_for_thread(const void *value);
+enum ThreadMode
+{
+    GC_THREAD_RUNNING,
+    GC_THREAD_BLOCKING,
+    GC_THREAD_CLAIMED
+};
 
-struct Allocation
+// Registry entry of a thread. Inside a blocking region the thread does not
+// touch the heap, so instead of signalling it the collector claims it and
+// scans the stack and registers it published; a claimed thread cannot
+// leave the region until the world restarts.
+struct ThreadState
 {
-    void *ptr;
-    size_t size;
-    char active;
-    char root;
-    char used;
+    pthread_t thread;
+    atomic_int mode;
+    void *stack_base;
+    void *stack_top;
+    jmp_buf regs;
+    struct ThreadState *claimed_next;
+    struct StackWatermark watermark;
+    int tid;
+    atomic_int perf_open;
+    struct PerfCounters perf;
 };
 
+unsigned hash_for_pointer(const void *value);
+unsigned hash_for_thread(const void *value);
+
 struct GarbageCollector
 {
-    struct HashMap *allocations;
+    struct Heap heap;
+    struct MarkPool mark_pool;
     struct HashMap *threads;
+    struct Roots roots;
     unsigned paused;
 
     atomic_int threads_to_scan;
     atomic_int allocation_cnt;
     atomic_int threads_registring;
+    atomic_int mark_overflowed;
+    atomic_int world_stopped;
+    atomic_int world_epoch;
 
     unsigned allocation_threshold;
+    atomic_size_t allocated_bytes;
+    size_t trigger_bytes;
+    size_t live_bytes;
+    unsigned heap_growth;
+    size_t min_heap;
+    size_t max_heap;
+    unsigned long cycle_start_ns;
+    unsigned long cycle_end_ns;
+    unsigned long last_mark_ns;
+
+    atomic_size_t allocated_objects;
+    struct GcCycleStats cycle;
+    struct GcStats stats;
+    unsigned long stopped_ns;
+    FILE *log;
+    struct AllocTrace alloc_trace;
+    int perf_counters;
+    unsigned counters_available;
+
+    int unaligned_scan;
+    size_t mark_stack_limit;
+    int donate_roots;
+    int concurrent;
+
+    int generational;
+    int soft_dirty;
+    int tracking;
+    unsigned minor_cnt;
+    unsigned major_interval;
+
+    enum GcPhase phase;
+    struct Marker incremental;
+    unsigned long incremental_budget;
+
+    struct Sweeper sweeper;
+    int background_sweep;
+
+    struct ThreadState *claimed;
+    atomic_int safepoint_requested;
+    unsigned long safepoint_wait_ns;
+    unsigned long safepoint_arrival;
+    unsigned long last_time_to_safepoint;
+    unsigned long max_time_to_safepoint;
+
+    int stack_watermark;
+    atomic_size_t stack_bytes_reused;
 
     pthread_mutex_t collect_garbage_mutex;
 };
@@ -41,27 +139,95 @@ struct GarbageCollector
 void gc_activate(void *ptr);
 void gc_deactivate(void *ptr);
 
+void gc_add_roots(void *start, void *end);
+void gc_remove_roots(void *start, void *end);
+void gc_exclude_range(void *start, void *end);
+
 void gc_create();
 void gc_destruct();
 void* gc_malloc(size_t size);
 void gc_free(void *ptr);
 void* gc_calloc(size_t nmemb, size_t size);
 void* gc_realloc(void *ptr, size_t size);
+// Memory from the _atomic variants is never scanned for pointers, which
+// suits strings, numeric arrays and other buffers. gc_realloc keeps the kind.
+void* gc_malloc_atomic(size_t size);
+void* gc_calloc_atomic(size_t nmemb, size_t size);
+// Only the words the descriptor marks as pointers are scanned; size may be
+// a multiple of the descriptor's type for arrays. gc_realloc keeps it.
+void* gc_malloc_typed(size_t size, const struct GcDescriptor *descriptor);
 
 void gc_register_thread();
 void gc_unregister_thread();
 
+void gc_enter_blocking();
+void gc_leave_blocking();
+// When a stop is requested, parks the thread like a blocking region and
+// returns once the world restarts.
+void gc_safepoint();
+
 void mark_stack();
 void mark_sections();
 void sweep();
 
 void collect_garbage();
+void collect_garbage_minor();
+void collect_garbage_major();
+enum GcPhase gc_collect_step(unsigned long budget_ns);
 
 void gc_pause();
 void gc_resume();
 
 int get_alive_allocations();
-
+size_t get_metadata_overhead();
+unsigned long get_time_to_safepoint();
+unsigned long get_max_time_to_safepoint();
+size_t get_stack_bytes_reused();
+void gc_get_stats(struct GcStats *stats);
+// Writes a line to stream after every cycle, NULL turns it off.
+void set_gc_log(FILE *stream);
+// Writes every allocation, gc_free() and collect_garbage() call and the
+// death of every object allocated since to stream in the binary format of
+// alloc_trace.h, NULL stops. The stream is left open.
+void set_allocation_trace(FILE *stream);
+// Opens performance counters for every registered thread and splits what
+// they count by phase in the statistics. Returns a bitmask of the enum
+// PerfCounter counters available, 0 if the kernel refuses them all.
+unsigned set_perf_counters(int enabled);
+// Records the phases of every collection in per-thread rings, to be
+// written out as Chrome trace JSON by gc_trace_dump().
+void set_tracing(int enabled);
+void gc_trace_dump(FILE *stream);
+
+// A nonzero threshold starts a collection after every threshold
+// allocations instead of by bytes. Allocations are then reported one at a
+// time rather than in per-thread batches, so the count is exact.
 void set_allocation_threshold(unsigned threshold);
+void set_heap_growth(unsigned percent);
+// A max_bytes below min_bytes is raised to it.
+void set_heap_limits(size_t min_bytes, size_t max_bytes);
+size_t get_live_bytes();
+size_t get_trigger_bytes();
+void set_unaligned_scan(int enabled);
+void set_mark_stack_limit(size_t entries);
+void set_marker_threads(unsigned count);
+// While marking runs concurrently or in slices (set_incremental(),
+// gc_collect_step()), heap pages that can hold pointers are write-protected.
+// The kernel must not write into such objects then: read(), recv() and the
+// like fail with EFAULT. Memory from gc_malloc_atomic() and
+// gc_calloc_atomic() stays writable.
+void set_concurrent_marking(int enabled);
+// Where the kernel lacks soft-dirty bits, the pages written between
+// collections are found by the same barrier, which then stays armed while
+// the program runs, so the EFAULT restriction above holds for as long as
+// generational collection is on. Turning it off disarms the barrier.
+void set_generational(int enabled);
+void set_major_collection_interval(unsigned minor_collections);
+void set_incremental(unsigned long budget_ns);
+void set_background_sweep(int enabled);
+void set_safepoint_polling(unsigned long wait_ns);
+void set_stack_watermark(int enabled);
+void set_root_discovery(int enabled);
+void set_large_object_threshold(size_t bytes);
 
 #endif // GC_H
\ No newline at end of file
@@ -0,0 +1,218 @@
+#ifndef HEAP_H
+#define HEAP_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "pagemap.h"
+
+#define GC_CHUNK_BLOCKS 64
+#define GC_GRANULE 16
+#define GC_MAX_SMALL_SIZE 1024
+#define GC_SMALL_CLASS_CNT 19
+// Every size class exists once per object kind, the classes of kind k
+// starting at k * GC_SMALL_CLASS_CNT, so that each block holds one kind.
+#define GC_SIZE_CLASS_CNT (GC_KIND_CNT * GC_SMALL_CLASS_CNT)
+#define GC_LARGE_CLASS GC_SIZE_CLASS_CNT
+
+#define GC_FREE_BATCH 64
+#define GC_MAP_THRESHOLD ((size_t)256 << 10)
+#define GC_MARK_WORDS (GC_BLOCK_SIZE / GC_GRANULE / 64)
+#define GC_MARK_SEGMENT_SLOTS (GC_BLOCK_SIZE / (GC_MARK_WORDS * sizeof(uint64_t)))
+
+#define GC_FLAG_ALLOCATED 1
+#define GC_FLAG_ACTIVE 2
+
+// Normal objects are scanned conservatively, pointer-free ones are marked
+// but never scanned, and typed ones are scanned through the descriptor
+// recorded for them.
+enum ObjectKind
+{
+    GC_KIND_NORMAL,
+    GC_KIND_POINTER_FREE,
+    GC_KIND_TYPED,
+    GC_KIND_CNT
+};
+
+struct GcDescriptor;
+
+// Descriptor of one heap block. Small blocks are GC_BLOCK_SIZE bytes of
+// equally sized objects, large blocks hold a single page-aligned object.
+// Per-object state is kept out of line in flags, one byte per object, and
+// dirty has one byte per GC_BLOCK_SIZE page for the write barrier. Mark
+// bits are not in the descriptor: marks points to the block's slot in the
+// heap's mark segments, which are the only memory marking writes to.
+// Typed blocks keep one descriptor per object in descriptors. Large
+// objects are also linked into the heap's large list; mapped ones have a
+// mapping of their own, which is unmapped by the sweep that follows the
+// cycle they die in.
+struct Block
+{
+    struct Block *next;
+    struct Block *all_next;
+    struct Block *all_prev;
+    struct Block *large_next;
+    struct Block *large_prev;
+    void *start;
+    size_t object_size;
+    unsigned size_class;
+    enum ObjectKind kind;
+    unsigned object_cnt;
+    unsigned free_cnt;
+    unsigned bump;
+    int sweep_pending;
+    int mapped;
+    void *free_list;
+    unsigned char *flags;
+    unsigned char *dirty;
+    uint64_t *marks;
+    const struct GcDescriptor **descriptors;
+};
+
+struct SizeClass
+{
+    size_t object_size;
+    unsigned object_cnt;
+    struct Block *partial;
+    struct Block *unswept;
+};
+
+struct MappedRegion
+{
+    void *start;
+    size_t size;
+};
+
+// Memory released by a sweep step, to be freed or unmapped outside the heap
+// lock. A block releases at most its descriptor and a large object.
+struct FreeBatch
+{
+    unsigned cnt;
+    void *ptrs[2 * GC_FREE_BATCH];
+    unsigned map_cnt;
+    struct MappedRegion maps[GC_FREE_BATCH];
+};
+
+struct Heap
+{
+    struct SizeClass classes[GC_SIZE_CLASS_CNT];
+    struct Block *blocks;
+    struct Block *large;
+    struct PageMap pagemap;
+    uintptr_t low;
+    uintptr_t high;
+
+    void *free_blocks;
+    void *chunk_cursor;
+    void *chunk_end;
+    void **chunks;
+    unsigned chunk_cnt;
+    unsigned chunk_capacity;
+
+    uint64_t **mark_segments;
+    unsigned mark_segment_cnt;
+    uint64_t **free_marks;
+    size_t free_mark_cnt;
+
+    size_t object_cnt;
+    size_t object_bytes;
+    size_t metadata_bytes;
+    size_t page_size;
+    size_t map_threshold;
+    size_t mapped_bytes;
+
+    int allocate_black;
+    int track_dirty;
+    struct Block *unswept_large;
+
+    pthread_mutex_t lock;
+};
+
+void heap_init(struct Heap *heap);
+void heap_destruct(struct Heap *heap);
+
+void *heap_alloc(struct Heap *heap, size_t size, enum ObjectKind kind);
+void heap_free(struct Heap *heap, struct Block *block, unsigned index);
+
+unsigned heap_size_class(size_t size, enum ObjectKind kind);
+
+// Cells handed to a thread cache count as allocated objects. Taking them
+// requires the heap lock, so that the cache can publish them before a
+// collection gets to see it.
+unsigned heap_take_cells(struct Heap *heap, unsigned size_class, void **cells, unsigned n);
+void heap_return(struct Heap *heap, void *const *cells, unsigned n);
+
+int heap_find_object(struct Heap *heap, const void *ptr, struct Block **block, unsigned *index);
+unsigned heap_resolve_many(struct Heap *heap, void *const *ptrs, unsigned n, struct Block **blocks, unsigned *indices);
+
+size_t block_span(const struct Block *block);
+
+void heap_clear_marks(struct Heap *heap);
+void heap_sweep(struct Heap *heap);
+void heap_sweep_begin(struct Heap *heap);
+int heap_sweep_step(struct Heap *heap, size_t budget, struct FreeBatch *batch);
+int heap_sweep_mapped(struct Heap *heap, struct FreeBatch *batch);
+void heap_free_batch(struct FreeBatch *batch);
+
+size_t heap_metadata_overhead(struct Heap *heap);
+// Bytes and number of the marked objects, read off the mark bitmaps.
+// Requires the heap lock.
+size_t heap_marked_bytes(struct Heap *heap, size_t *objects);
+
+static inline void *block_object(const struct Block *block, unsigned index)
+{
+    return (char *)block->start + (size_t)index * block->object_size;
+}
+
+static inline int block_marked(const struct Block *block, unsigned index)
+{
+    return (__atomic_load_n(&block->marks[index / 64], __ATOMIC_RELAXED) >> (index % 64)) & 1;
+}
+
+// Returns whether the object was marked already, so that with several
+// markers exactly one of them wins it.
+static inline int block_mark(struct Block *block, unsigned index)
+{
+    uint64_t bit = (uint64_t)1 << (index % 64);
+    return (__atomic_fetch_or(&block->marks[index / 64], bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+static inline void block_unmark(struct Block *block, unsigned index)
+{
+    __atomic_fetch_and(&block->marks[index / 64], ~((uint64_t)1 << (index % 64)), __ATOMIC_RELAXED);
+}
+
+// A freed typed object loses its descriptor, so that until the next owner
+// stores one the object is scanned conservatively.
+static inline void block_clear_descriptor(struct Block *block, unsigned index)
+{
+    if (block->descriptors != NULL)
+    {
+        __atomic_store_n(&block->descriptors[index], NULL, __ATOMIC_RELAXED);
+    }
+}
+
+// Resolves any address inside a live object, including interior pointers,
+// to its block and index. Lock-free, so it is safe to call from the
+// stack-scanning signal handler.
+static inline int heap_resolve(struct Heap *heap, const void *ptr, struct Block **block, unsigned *index)
+{
+    struct Block *b = pagemap_get(&heap->pagemap, ptr);
+    if (b == NULL)
+    {
+        return 0;
+    }
+
+    size_t offset = (const char *)ptr - (const char *)b->start;
+    unsigned i = b->object_cnt == 1 ? 0 : offset / b->object_size;
+    if (i >= b->object_cnt || offset - (size_t)i * b->object_size >= b->object_size || !(b->flags[i] & GC_FLAG_ALLOCATED))
+    {
+        return 0;
+    }
+
+    *block = b;
+    *index = i;
+    return 1;
+}
+
+#endif // HEAP_H
@@ -0,0 +1,71 @@
+#ifndef MARK_H
+#define MARK_H
+
+#include <stddef.h>
+#include "descriptor.h"
+#include "heap.h"
+#include "scan.h"
+
+#define GC_CANDIDATE_BATCH 32
+#define GC_MARK_FIFO_SIZE 8
+#define GC_MARK_STACK_INITIAL 4096
+#define GC_MARK_STACK_LIMIT ((size_t)1 << 20)
+#define GC_MARK_CHUNK 4096
+
+// Typed objects carry their descriptor; their entries start at an element
+// boundary.
+struct MarkEntry
+{
+    void *start;
+    void *end;
+    const struct GcDescriptor *descriptor;
+};
+
+// Words that passed the heap-bounds filter are queued here and resolved a
+// batch at a time, so the page-map misses of a batch overlap.
+struct Candidates
+{
+    unsigned cnt;
+    void *ptrs[GC_CANDIDATE_BATCH];
+};
+
+// Iterative marker. Grey objects wait on an explicit, mmap-backed stack that
+// grows up to limit entries; pushes beyond that only set overflowed and the
+// object is picked up again by marker_rescan_heap. Popped entries pass
+// through a small FIFO so that their memory is prefetched before the scan,
+// and entries longer than GC_MARK_CHUNK are split so that large objects can
+// be shared between parallel markers. scanned counts the bytes of roots and
+// objects scanned.
+struct Marker
+{
+    struct Heap *heap;
+    struct ScanRange range;
+    struct Candidates candidates;
+
+    struct MarkEntry *stack;
+    size_t size;
+    size_t capacity;
+    size_t limit;
+    int overflowed;
+    size_t scanned;
+
+    struct MarkEntry fifo[GC_MARK_FIFO_SIZE];
+    unsigned fifo_head;
+    unsigned fifo_cnt;
+};
+
+void marker_init(struct Marker *marker, struct Heap *heap, size_t limit, int unaligned);
+void marker_destruct(struct Marker *marker);
+
+void marker_push_entry(struct Marker *marker, struct MarkEntry entry);
+void marker_scan_roots(struct Marker *marker, const void *start, const void *end);
+// Queues a single word already known to be within the heap bounds; the
+// queue is resolved by marker_flush_roots or once a batch fills up.
+void marker_add_root(struct Marker *marker, void *ptr);
+void marker_flush_roots(struct Marker *marker);
+int marker_step(struct Marker *marker, size_t budget);
+void marker_drain(struct Marker *marker);
+void marker_rescan_heap(struct Marker *marker);
+void marker_rescan_dirty(struct Marker *marker);
+
+#endif // MARK_H
@@ -11,4 +11,11 @@ void *get_bss_end();
 void *get_data_start();
 void *get_data_end();
 
+typedef void (*segment_visitor)(void *start, void *end, void *ctx);
+
+// Writable segments of every loaded object, the executable included. The
+// version changes whenever an object is loaded or unloaded.
+void for_each_writable_segment(segment_visitor visitor, void *ctx);
+unsigned long get_loaded_objects_version();
+
 #endif // MEMORY_ACCESS_H
\ No newline at end of file
@@ -0,0 +1,45 @@
+#ifndef PAGEMAP_H
+#define PAGEMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GC_BLOCK_SHIFT 12
+#define GC_BLOCK_SIZE ((size_t)1 << GC_BLOCK_SHIFT)
+#define GC_ADDRESS_BITS 48
+#define GC_PAGEMAP_LEAF_BITS 18
+#define GC_PAGEMAP_TOP_BITS (GC_ADDRESS_BITS - GC_BLOCK_SHIFT - GC_PAGEMAP_LEAF_BITS)
+
+struct Block;
+
+// Two-level radix map from GC_BLOCK_SIZE pages to their owning block.
+// Both levels are mmap-ed, so untouched parts cost no physical memory.
+struct PageMap
+{
+    struct Block ***top;
+    size_t leaf_cnt;
+    size_t entry_cnt;
+};
+
+void pagemap_init(struct PageMap *map);
+void pagemap_destruct(struct PageMap *map);
+int pagemap_set(struct PageMap *map, const void *start, size_t size, struct Block *block);
+size_t pagemap_overhead(const struct PageMap *map);
+void pagemap_get_many(const struct PageMap *map, void *const *ptrs, unsigned n, struct Block **out);
+
+static inline struct Block *pagemap_get(const struct PageMap *map, const void *ptr)
+{
+    uint64_t addr = (uint64_t)(uintptr_t)ptr;
+    if (addr >> GC_ADDRESS_BITS)
+    {
+        return NULL;
+    }
+    struct Block **leaf = map->top[addr >> (GC_BLOCK_SHIFT + GC_PAGEMAP_LEAF_BITS)];
+    if (leaf == NULL)
+    {
+        return NULL;
+    }
+    return leaf[(addr >> GC_BLOCK_SHIFT) & ((1 << GC_PAGEMAP_LEAF_BITS) - 1)];
+}
+
+#endif // PAGEMAP_H
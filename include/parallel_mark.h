@@ -0,0 +1,60 @@
+#ifndef PARALLEL_MARK_H
+#define PARALLEL_MARK_H
+
+#include <pthread.h>
+#include "mark.h"
+
+#define GC_SHARE_INTERVAL 32
+
+// One marker thread. Its Marker is private; entries it is willing to give
+// away are moved to shared, from where idle workers steal them.
+struct MarkWorker
+{
+    struct Marker marker;
+    struct MarkPool *pool;
+    pthread_t thread;
+
+    int lock;
+    size_t shared_cnt;
+    size_t shared_capacity;
+    struct MarkEntry *shared;
+};
+
+// Pool of marker threads. Root scanners donate their grey entries to roots;
+// mark_pool_run deals them out to the workers and traces the heap graph in
+// parallel, with work stealing between the workers' shared queues. Worker 0
+// is the thread that calls mark_pool_run, after which scanned holds the
+// bytes the workers scanned in that run.
+struct MarkPool
+{
+    struct Heap *heap;
+    unsigned worker_cnt;
+    struct MarkWorker *workers;
+
+    int roots_lock;
+    struct MarkEntry *roots;
+    size_t root_cnt;
+    size_t root_capacity;
+
+    size_t limit;
+    int unaligned;
+    int active;
+    int overflowed;
+    size_t scanned;
+
+    unsigned epoch;
+    unsigned finished;
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+};
+
+void mark_pool_init(struct MarkPool *pool, struct Heap *heap, unsigned worker_cnt);
+void mark_pool_destruct(struct MarkPool *pool);
+
+void mark_pool_donate(struct MarkPool *pool, struct Marker *marker);
+void mark_pool_take(struct MarkPool *pool, struct Marker *marker);
+int mark_pool_run(struct MarkPool *pool, size_t limit, int unaligned);
+
+#endif // PARALLEL_MARK_H
@@ -0,0 +1,36 @@
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdint.h>
+
+enum PerfCounter
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_CACHE_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_TASK_CLOCK,
+    PERF_COUNTER_CNT
+};
+
+// Counters of one thread, opened with perf_event_open and counting user
+// space only. Each counter is opened on its own: one the kernel or the CPU
+// refuses stays closed and reads as 0, and without perf_event_open all of
+// them do.
+struct PerfCounters
+{
+    int fds[PERF_COUNTER_CNT];
+};
+
+extern const char *const perf_counter_names[PERF_COUNTER_CNT];
+
+void perf_counters_init(struct PerfCounters *counters);
+// Opens the counters of thread tid and returns a bitmask of those that
+// opened.
+unsigned perf_counters_open(struct PerfCounters *counters, int tid);
+void perf_counters_close(struct PerfCounters *counters);
+// Async-signal-safe.
+void perf_counters_read(const struct PerfCounters *counters, uint64_t *values);
+int perf_thread_id();
+
+#endif // PERF_COUNTERS_H
@@ -0,0 +1,51 @@
+#ifndef ROOTS_H
+#define ROOTS_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "memory_access.h"
+
+struct RootRange
+{
+    char *start;
+    char *end;
+};
+
+struct RangeList
+{
+    struct RootRange *ranges;
+    size_t cnt;
+    size_t capacity;
+};
+
+// Static roots. By default these are the executable's .data and .bss; with
+// discovery on, the writable segments of every loaded object instead,
+// enumerated again only when an object has been loaded or unloaded since.
+// Ranges added explicitly are scanned in either mode, and excluded ranges
+// are cut out of all of them.
+struct Roots
+{
+    struct RangeList added;
+    struct RangeList excluded;
+    struct RangeList segments;
+    int discover;
+    int segments_valid;
+    unsigned long version;
+    pthread_mutex_t lock;
+};
+
+void roots_init(struct Roots *roots);
+void roots_destruct(struct Roots *roots);
+
+void roots_add(struct Roots *roots, void *start, void *end);
+// Removes the added ranges that lie within [start, end).
+void roots_remove(struct Roots *roots, void *start, void *end);
+void roots_exclude(struct Roots *roots, void *start, void *end);
+void roots_set_discovery(struct Roots *roots, int enabled);
+
+// Enumerates the loaded objects again if they have changed. Takes the
+// loader's lock, so it must not be called while other threads are stopped.
+void roots_refresh(struct Roots *roots);
+void roots_for_each(struct Roots *roots, segment_visitor visitor, void *ctx);
+
+#endif // ROOTS_H
@@ -0,0 +1,28 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*scan_visitor)(void *ptr, void *ctx);
+
+// Conservative scan of [start, end). Every word whose value lies in
+// [low, high) is passed to visit, everything else is rejected without a
+// heap lookup. Aligned mode reads only pointer-aligned words; unaligned mode
+// additionally considers a word at every byte offset.
+struct ScanRange
+{
+    uintptr_t low;
+    uintptr_t high;
+    int unaligned;
+};
+
+void scan_init();
+const char *scan_kernel_name();
+// Selects a kernel by the name scan_kernel_name() would report, for tests
+// and benchmarks; returns 0 if it is not built in or the CPU lacks it.
+// scan_init() goes back to the one the CPU supports best.
+int scan_use_kernel(const char *name);
+void scan_words(const void *start, const void *end, const struct ScanRange *range, scan_visitor visit, void *ctx);
+
+#endif // SCAN_H
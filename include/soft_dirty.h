@@ -0,0 +1,17 @@
+#ifndef SOFT_DIRTY_H
+#define SOFT_DIRTY_H
+
+#include "heap.h"
+
+// Linux soft-dirty page tracking through /proc/self/clear_refs and
+// /proc/self/pagemap. soft_dirty_init() probes whether the kernel really
+// maintains the bit and returns 0 if it does not. soft_dirty_collect()
+// stores into the blocks' dirty maps which heap pages were written since
+// the last soft_dirty_clear().
+int soft_dirty_init();
+void soft_dirty_destruct();
+
+void soft_dirty_clear();
+void soft_dirty_collect(struct Heap *heap);
+
+#endif // SOFT_DIRTY_H
@@ -0,0 +1,40 @@
+#ifndef STACK_WATERMARK_H
+#define STACK_WATERMARK_H
+
+#include <stddef.h>
+#include "mark.h"
+
+#define GC_WATERMARK_CHUNK 256
+
+struct StackHit
+{
+    size_t offset;
+    void *value;
+};
+
+// A thread's stack as of its last scan, with the words in it that passed
+// the heap-bounds filter. Frames near the stack base rarely change between
+// collections; a scan compares the stack with the copy from the base
+// downwards, a chunk at a time, and for the part that is unchanged only
+// re-marks the recorded words. Offsets are counted from the stack base.
+// Buffers are mmap'd, as the scan runs in the signal handler.
+struct StackWatermark
+{
+    char *copy;
+    size_t copy_size;
+    size_t copy_capacity;
+
+    struct StackHit *hits;
+    size_t hit_cnt;
+    size_t hit_capacity;
+
+    size_t reused;
+};
+
+void watermark_init(struct StackWatermark *watermark);
+void watermark_destruct(struct StackWatermark *watermark);
+
+// Marks the roots in [top, base), top being the lower address.
+void watermark_scan(struct StackWatermark *watermark, struct Marker *marker, const void *top, const void *base);
+
+#endif // STACK_WATERMARK_H
@@ -0,0 +1,75 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "perf_counters.h"
+
+// Pauses are counted in power-of-two microsecond buckets: bucket 0 holds
+// pauses under 1us, bucket i those under 2^i us, the last one the rest.
+#define GC_PAUSE_BUCKETS 24
+
+// Phases the performance counters are split by. mark_stack sums the stack
+// scans of all registered threads, the collector's own included, which
+// also falls within roots.
+enum CounterPhase
+{
+    GC_COUNT_SWEEP,
+    GC_COUNT_ROOTS,
+    GC_COUNT_MARK_STACK,
+    GC_COUNT_MARK,
+    GC_COUNT_PHASE_CNT
+};
+
+// Figures of one collection cycle. Times are in nanoseconds and cover the
+// collector's work in the cycle: finishing the sweep of the previous cycle
+// (sweep_ns), stopping the world (stop_ns), scanning stacks and root ranges
+// (roots_ns) and tracing (mark_ns). pause_ns is the time the world was
+// stopped. Allocated figures count what was allocated since the previous
+// cycle, freed ones what the sweep of this cycle releases. scanned_words
+// counts the words of roots and objects the markers scanned, and counters
+// holds per phase what the available performance counters of the threads
+// doing the work counted.
+struct GcCycleStats
+{
+    unsigned long pause_ns;
+    unsigned long stop_ns;
+    unsigned long roots_ns;
+    unsigned long mark_ns;
+    unsigned long sweep_ns;
+
+    size_t allocated_bytes;
+    size_t allocated_objects;
+    size_t marked_bytes;
+    size_t marked_objects;
+    size_t freed_bytes;
+    size_t freed_objects;
+    size_t scanned_words;
+
+    uint64_t counters[GC_COUNT_PHASE_CNT][PERF_COUNTER_CNT];
+};
+
+struct GcStats
+{
+    unsigned long cycles;
+    unsigned long minor_cycles;
+    struct GcCycleStats total;
+    struct GcCycleStats last;
+    int last_minor;
+    unsigned long max_pause_ns;
+    unsigned long pause_histogram[GC_PAUSE_BUCKETS];
+
+    size_t live_bytes;
+    size_t metadata_bytes;
+    // bitmask of the enum PerfCounter counters that could be opened
+    unsigned counters_available;
+};
+
+void stats_init(struct GcStats *stats);
+// Adds a finished cycle to the totals and the pause histogram.
+void stats_record(struct GcStats *stats, const struct GcCycleStats *cycle, int minor);
+// Writes one line describing the last cycle.
+void stats_log(const struct GcStats *stats, FILE *stream);
+
+#endif // STATS_H
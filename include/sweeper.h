@@ -0,0 +1,31 @@
+#ifndef SWEEPER_H
+#define SWEEPER_H
+
+#include <pthread.h>
+#include "heap.h"
+
+// Background sweeper. After sweeper_wake the thread works through the
+// heap's sweep queues a batch of blocks at a time, holding the heap lock
+// only for the sweep itself; the memory a batch releases is freed after
+// the lock is dropped. Allocation still sweeps a queued block of its own
+// class when the sweeper has not reached it yet.
+struct Sweeper
+{
+    struct Heap *heap;
+    pthread_t thread;
+
+    unsigned requested;
+    unsigned completed;
+    int shutdown;
+    pthread_mutex_t lock;
+    pthread_cond_t wake_cond;
+    pthread_cond_t done_cond;
+};
+
+int sweeper_init(struct Sweeper *sweeper, struct Heap *heap);
+void sweeper_destruct(struct Sweeper *sweeper);
+
+void sweeper_wake(struct Sweeper *sweeper);
+void sweeper_wait(struct Sweeper *sweeper);
+
+#endif // SWEEPER_H
@@ -0,0 +1,43 @@
+#ifndef THREAD_CACHE_H
+#define THREAD_CACHE_H
+
+#include "heap.h"
+
+#define GC_CACHE_CELLS 64
+#define GC_CACHE_BATCH 32
+
+struct ClassCache
+{
+    unsigned cnt;
+    void *cells[GC_CACHE_CELLS];
+};
+
+// Per-thread stock of free cells for every small size class. Allocation
+// and freeing work on the stock without the heap lock; the heap is only
+// visited to refill or flush GC_CACHE_BATCH cells at once. A cached cell
+// has no flags set, so to the marker and the sweeper it is neither free
+// nor allocated. A pop publishes the cell's flags before dropping it from
+// the stock, and the collector marks every cell still cached before the
+// world restarts, so nothing allocated after the marking finished is lost
+// to the sweep that follows.
+struct ThreadCache
+{
+    pthread_t owner;
+    struct ThreadCache *next;
+    struct ThreadCache *prev;
+    struct ClassCache classes[GC_SIZE_CLASS_CNT];
+};
+
+void cache_init(struct Heap *heap);
+void cache_destruct(struct Heap *heap);
+
+struct ThreadCache *cache_get(struct Heap *heap);
+void *cache_alloc(struct Heap *heap, struct ThreadCache *cache, unsigned size_class);
+void cache_free(struct Heap *heap, struct ThreadCache *cache, struct Block *block, unsigned index);
+
+// All need the heap lock. Cached cells count as objects of the heap.
+void cache_mark_cells(struct Heap *heap);
+size_t cache_cell_cnt(struct Heap *heap);
+size_t cache_cell_bytes(struct Heap *heap, size_t *cells);
+
+#endif // THREAD_CACHE_H
@@ -0,0 +1,67 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#if defined(__has_include)
+    #if __has_include(<sys/sdt.h>)
+        #include <sys/sdt.h>
+        #define GC_PROBE(name, phase) DTRACE_PROBE2(gc, name, phase, trace_phase_names[phase])
+    #endif
+#endif
+#ifndef GC_PROBE
+    #define GC_PROBE(name, phase) ((void)(phase))
+#endif
+
+#define GC_TRACE_EVENTS 4096
+
+enum TracePhase
+{
+    TRACE_COLLECT,
+    TRACE_STEP,
+    TRACE_SCAN_THREADS,
+    TRACE_MARK_STACK,
+    TRACE_STOPPED,
+    TRACE_MARK_SECTIONS,
+    TRACE_MARK,
+    TRACE_SWEEP,
+    TRACE_PHASE_CNT
+};
+
+extern const char *const trace_phase_names[TRACE_PHASE_CNT];
+extern int trace_enabled;
+
+// Every phase is a USDT probe pair gc:phase_begin and gc:phase_end, with
+// the phase number and name as arguments, when <sys/sdt.h> is available.
+// With tracing on, the phase is also recorded as an event in a ring of
+// GC_TRACE_EVENTS events owned by the calling thread. Recording takes no
+// locks and only mmaps the ring on the thread's first event, so phases
+// run in the stack-scanning signal handler can be traced too.
+void trace_set_enabled(int enabled);
+unsigned long trace_clock();
+void trace_record(enum TracePhase phase, unsigned long start);
+
+// Hands the calling thread's ring over to the next thread that needs one.
+// Its events stay until they are overwritten.
+void trace_thread_exit();
+
+// Writes the recorded events as Chrome trace JSON, oldest first per thread.
+void trace_dump(FILE *stream);
+
+static inline unsigned long trace_begin(enum TracePhase phase)
+{
+    GC_PROBE(phase_begin, phase);
+    return __atomic_load_n(&trace_enabled, __ATOMIC_RELAXED) ? trace_clock() : 0;
+}
+
+static inline void trace_end(enum TracePhase phase, unsigned long start)
+{
+    GC_PROBE(phase_end, phase);
+    if (start != 0)
+    {
+        trace_record(phase, start);
+    }
+}
+
+#endif // TRACE_H
@@ -0,0 +1,16 @@
+#ifndef WRITE_BARRIER_H
+#define WRITE_BARRIER_H
+
+#include "heap.h"
+
+// Page-protection write barrier for concurrent marking. While it is armed
+// every heap page is read-only; the first write to a page faults, the
+// SIGSEGV handler records the page as dirty in its block and makes it
+// writable again. Arming and disarming require the heap lock.
+void barrier_install(struct Heap *heap);
+void barrier_uninstall();
+
+void barrier_arm(struct Heap *heap);
+void barrier_disarm(struct Heap *heap);
+
+#endif // WRITE_BARRIER_H
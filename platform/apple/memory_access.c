@@ -1,3 +1,4 @@
+#include "memory_access.h"
 #include <mach-o/getsect.h>
 #include <mach-o/dyld.h>
 #include <pthread.h>
@@ -94,3 +95,27 @@ void *get_data_end()
     uint8_t *data_start = (uint8_t *)getsectiondata(header, "__DATA", "__data", &data_size);
     return (void *)(data_start + data_size);
 }
+
+void for_each_writable_segment(segment_visitor visitor, void *ctx)
+{
+    for (uint32_t i = 0; i < _dyld_image_count(); i++)
+    {
+        const struct mach_header_64 *header = (const struct mach_header_64 *)_dyld_get_image_header(i);
+        if (header == NULL || header->magic != MH_MAGIC_64)
+        {
+            continue;
+        }
+        unsigned long size = 0;
+        uint8_t *start = getsegmentdata(header, "__DATA", &size);
+        if (start != NULL && size != 0)
+        {
+            visitor(start, start + size, ctx);
+        }
+    }
+}
+
+// Images are practically never unloaded, so their count is enough.
+unsigned long get_loaded_objects_version()
+{
+    return _dyld_image_count();
+}
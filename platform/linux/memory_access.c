@@ -1,5 +1,8 @@
 #define _GNU_SOURCE
+#include "memory_access.h"
+#include <link.h>
 #include <pthread.h>
+#include <stddef.h>
 #include <stdio.h>
 
 void *get_stack_base()
@@ -71,4 +74,75 @@ void *get_data_start()
 void *get_data_end()
 {
     return (void *)_edata;
-}
\ No newline at end of file
+}
+
+struct SegmentVisit
+{
+    segment_visitor visitor;
+    void *ctx;
+};
+
+// The RELRO part of a writable segment is read-only after relocation and
+// holds no pointers into the heap, so it is left out.
+static int visit_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+    (void)size;
+    struct SegmentVisit *visit = data;
+    char *relro_start = NULL;
+    char *relro_end = NULL;
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++)
+    {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type == PT_GNU_RELRO)
+        {
+            relro_start = (char *)(info->dlpi_addr + phdr->p_vaddr);
+            relro_end = relro_start + phdr->p_memsz;
+        }
+    }
+
+    for (ElfW(Half) i = 0; i < info->dlpi_phnum; i++)
+    {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_W))
+        {
+            continue;
+        }
+        char *start = (char *)(info->dlpi_addr + phdr->p_vaddr);
+        char *end = start + phdr->p_memsz;
+        if (relro_start < end && relro_end > start)
+        {
+            if (relro_start > start)
+            {
+                visit->visitor(start, relro_start, visit->ctx);
+            }
+            start = relro_end;
+        }
+        if (start < end)
+        {
+            visit->visitor(start, end, visit->ctx);
+        }
+    }
+    return 0;
+}
+
+void for_each_writable_segment(segment_visitor visitor, void *ctx)
+{
+    struct SegmentVisit visit = {visitor, ctx};
+    dl_iterate_phdr(visit_object, &visit);
+}
+
+static int read_version(struct dl_phdr_info *info, size_t size, void *data)
+{
+    if (size >= offsetof(struct dl_phdr_info, dlpi_subs) + sizeof(info->dlpi_subs))
+    {
+        *(unsigned long *)data = info->dlpi_adds + info->dlpi_subs;
+    }
+    return 1;
+}
+
+unsigned long get_loaded_objects_version()
+{
+    unsigned long version = 0;
+    dl_iterate_phdr(read_version, &version);
+    return version;
+}
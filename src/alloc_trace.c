@@ -0,0 +1,408 @@
+#include "alloc_trace.h"
+
+#include <string.h>
+#include <time.h>
+#include "perf_counters.h"
+#include "safe_functions.h"
+
+struct TracedObject
+{
+    uint64_t id;
+    // position among the traced allocations, to tell objects allocated
+    // after the marking from dead ones
+    uint64_t seq;
+};
+
+static __thread int thread_id = 0;
+
+// Objects allocated one after another sit next to each other, and with
+// linear probing consecutive hashes would pile up into long runs.
+static unsigned pointer_hash(const void *value)
+{
+    return (unsigned)((*(const uintptr_t *)value * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+void alloc_trace_init(struct AllocTrace *trace)
+{
+    trace->stream = NULL;
+    trace->enabled = 0;
+    trace->objects = hashmap_create(sizeof(void *), sizeof(struct TracedObject), pointer_hash);
+    trace->free_ids = NULL;
+    trace->free_id_cnt = 0;
+    trace->free_id_capacity = 0;
+    trace->next_id = 0;
+    trace->allocations = 0;
+    trace->cycle_allocations = 0;
+    trace->last_ns = 0;
+    pthread_mutex_init(&trace->lock, NULL);
+}
+
+void alloc_trace_destruct(struct AllocTrace *trace)
+{
+    alloc_trace_start(trace, NULL);
+    hashmap_destruct(trace->objects);
+    free(trace->objects);
+    free(trace->free_ids);
+    pthread_mutex_destroy(&trace->lock);
+}
+
+static void forget_objects(struct AllocTrace *trace)
+{
+    hashmap_destruct(trace->objects);
+    free(trace->objects);
+    trace->objects = hashmap_create(sizeof(void *), sizeof(struct TracedObject), pointer_hash);
+    trace->free_id_cnt = 0;
+    trace->next_id = 0;
+}
+
+void alloc_trace_start(struct AllocTrace *trace, FILE *stream)
+{
+    pthread_mutex_lock(&trace->lock);
+    if (trace->stream != NULL)
+    {
+        fflush(trace->stream);
+    }
+    forget_objects(trace);
+    trace->stream = stream;
+    if (stream != NULL)
+    {
+        fwrite(GC_ALLOC_TRACE_MAGIC, 1, strlen(GC_ALLOC_TRACE_MAGIC), stream);
+    }
+    trace->last_ns = 0;
+    __atomic_store_n(&trace->enabled, stream != NULL, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace->lock);
+}
+
+static size_t put_varint(unsigned char *buf, uint64_t value)
+{
+    size_t len = 0;
+    while (value >= 0x80)
+    {
+        buf[len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = (unsigned char)value;
+    return len;
+}
+
+// Requires the recorder's lock.
+static void write_event(struct AllocTrace *trace, enum AllocEventType type, unsigned variant, uint64_t id, size_t size)
+{
+    if (thread_id == 0)
+    {
+        thread_id = perf_thread_id();
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long ns = now.tv_sec * 1000000000UL + now.tv_nsec;
+    unsigned long delta = trace->last_ns != 0 && ns > trace->last_ns ? ns - trace->last_ns : 0;
+    trace->last_ns = ns;
+
+    unsigned char buf[1 + 4 * 10];
+    size_t len = 0;
+    buf[len++] = (unsigned char)(type | variant << 4);
+    len += put_varint(buf + len, (uint64_t)thread_id);
+    len += put_varint(buf + len, delta);
+    if (type != GC_EVENT_COLLECT)
+    {
+        len += put_varint(buf + len, id);
+    }
+    if (type == GC_EVENT_MALLOC || type == GC_EVENT_CALLOC || type == GC_EVENT_REALLOC)
+    {
+        len += put_varint(buf + len, size);
+    }
+    fwrite(buf, 1, len, trace->stream);
+}
+
+static uint64_t take_id(struct AllocTrace *trace)
+{
+    return trace->free_id_cnt != 0 ? trace->free_ids[--trace->free_id_cnt] : trace->next_id++;
+}
+
+static void release_id(struct AllocTrace *trace, uint64_t id)
+{
+    if (trace->free_id_cnt == trace->free_id_capacity)
+    {
+        trace->free_id_capacity = trace->free_id_capacity ? 2 * trace->free_id_capacity : 1024;
+        trace->free_ids = safe_realloc(trace->free_ids, trace->free_id_capacity * sizeof(uint64_t));
+    }
+    trace->free_ids[trace->free_id_cnt++] = id;
+}
+
+// Maps ptr to a new object. A traced object still mapped at the same
+// address must have been collected since, as its memory is being handed
+// out again, so its death is written first.
+static void place(struct AllocTrace *trace, void *ptr, uint64_t id)
+{
+    struct TracedObject object = {id, trace->allocations++};
+    struct Iterator it = hashmap_find(trace->objects, &ptr);
+    if (hashmap_not_end(it))
+    {
+        struct TracedObject *dead = it.value;
+        write_event(trace, GC_EVENT_DEATH, 0, dead->id, 0);
+        release_id(trace, dead->id);
+        *dead = object;
+        allow_writing(it);
+        return;
+    }
+    allow_writing(it);
+    // the map only grows on insertion, even when most of it is deleted
+    // entries, so those are dropped first
+    struct HashMap *map = trace->objects;
+    if (map->size + map->deleted_cnt + 1 >= map->max_load_factor * map->capacity && map->deleted_cnt >= map->size)
+    {
+        hashmap_rebuild(map, map->capacity);
+    }
+    hashmap_insert(map, &ptr, &object);
+}
+
+void alloc_trace_allocate(struct AllocTrace *trace, enum AllocEventType type, enum ObjectKind kind, void *ptr, size_t size)
+{
+    if (!__atomic_load_n(&trace->enabled, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    pthread_mutex_lock(&trace->lock);
+    if (trace->stream != NULL)
+    {
+        uint64_t id = take_id(trace);
+        place(trace, ptr, id);
+        write_event(trace, type, kind, id, size);
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+void alloc_trace_realloc(struct AllocTrace *trace, void *old_ptr, void *new_ptr, enum ObjectKind kind, size_t size)
+{
+    if (!__atomic_load_n(&trace->enabled, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    pthread_mutex_lock(&trace->lock);
+    if (trace->stream == NULL)
+    {
+        pthread_mutex_unlock(&trace->lock);
+        return;
+    }
+
+    struct Iterator it = hashmap_find(trace->objects, &old_ptr);
+    int traced = hashmap_not_end(it);
+    uint64_t id = traced ? ((struct TracedObject *)it.value)->id : 0;
+    allow_writing(it);
+    if (!traced)
+    {
+        // allocated before the recording started: traced from here on
+        id = take_id(trace);
+        place(trace, new_ptr, id);
+        write_event(trace, GC_EVENT_MALLOC, kind, id, size);
+    }
+    else if (new_ptr != old_ptr)
+    {
+        hashmap_erase(trace->objects, &old_ptr);
+        place(trace, new_ptr, id);
+        write_event(trace, GC_EVENT_REALLOC, kind, id, size);
+    }
+    else
+    {
+        write_event(trace, GC_EVENT_REALLOC, kind, id, size);
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+void alloc_trace_free(struct AllocTrace *trace, void *ptr)
+{
+    if (!__atomic_load_n(&trace->enabled, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    pthread_mutex_lock(&trace->lock);
+    struct Iterator it = hashmap_find(trace->objects, &ptr);
+    int traced = hashmap_not_end(it);
+    if (traced)
+    {
+        uint64_t id = ((struct TracedObject *)it.value)->id;
+        write_event(trace, GC_EVENT_FREE, 0, id, 0);
+        release_id(trace, id);
+    }
+    allow_writing(it);
+    if (traced)
+    {
+        hashmap_erase(trace->objects, &ptr);
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+void alloc_trace_collect(struct AllocTrace *trace, enum AllocTraceCollect variant)
+{
+    if (!__atomic_load_n(&trace->enabled, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+    pthread_mutex_lock(&trace->lock);
+    if (trace->stream != NULL)
+    {
+        write_event(trace, GC_EVENT_COLLECT, variant, 0, 0);
+    }
+    pthread_mutex_unlock(&trace->lock);
+}
+
+void alloc_trace_mark_done(struct AllocTrace *trace)
+{
+    __atomic_store_n(&trace->cycle_allocations, __atomic_load_n(&trace->allocations, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+// An unmarked object is swept unless it has been deactivated, that is, it is
+// still allocated but not active. A cell the sweep has freed already, for
+// one by the background sweeper since the world restarted, is dead.
+static int survives(struct Heap *heap, void *ptr)
+{
+    struct Block *block;
+    unsigned index;
+    if (!heap_find_object(heap, ptr, &block, &index))
+    {
+        return 0;
+    }
+    unsigned char flags = __atomic_load_n(&block->flags[index], __ATOMIC_RELAXED);
+    if (!(flags & GC_FLAG_ALLOCATED))
+    {
+        return 0;
+    }
+    return block_marked(block, index) || !(flags & GC_FLAG_ACTIVE);
+}
+
+// An object is told apart from a later one at the same address by its seq.
+struct Candidate
+{
+    void *ptr;
+    uint64_t seq;
+};
+
+void alloc_trace_sweep(struct AllocTrace *trace, struct Heap *heap)
+{
+    if (!__atomic_load_n(&trace->enabled, __ATOMIC_RELAXED))
+    {
+        return;
+    }
+
+    struct Candidate *candidates = NULL;
+    size_t cnt = 0;
+    size_t capacity = 0;
+    pthread_mutex_lock(&trace->lock);
+    struct Iterator it = hashmap_begin(trace->objects);
+    while (hashmap_not_end(it))
+    {
+        struct TracedObject *object = it.value;
+        if (object->seq < trace->cycle_allocations)
+        {
+            if (cnt == capacity)
+            {
+                capacity = capacity ? 2 * capacity : 1024;
+                candidates = safe_realloc(candidates, capacity * sizeof(struct Candidate));
+            }
+            candidates[cnt].ptr = *(void **)it.key;
+            candidates[cnt].seq = object->seq;
+            cnt++;
+        }
+        it = hashmap_next(it);
+    }
+    allow_writing(it);
+    pthread_mutex_unlock(&trace->lock);
+
+    // the heap lock is only held for a batch at a time, as allocations
+    // refilling their caches wait for it
+    size_t dead_cnt = 0;
+    for (size_t first = 0; first < cnt; first += GC_TRACE_SWEEP_BATCH)
+    {
+        size_t last = first + GC_TRACE_SWEEP_BATCH < cnt ? first + GC_TRACE_SWEEP_BATCH : cnt;
+        pthread_mutex_lock(&heap->lock);
+        for (size_t i = first; i < last; i++)
+        {
+            if (!survives(heap, candidates[i].ptr))
+            {
+                candidates[dead_cnt++] = candidates[i];
+            }
+        }
+        pthread_mutex_unlock(&heap->lock);
+    }
+
+    // an object freed or replaced at its address in the meantime has been
+    // accounted for already
+    pthread_mutex_lock(&trace->lock);
+    for (size_t i = 0; i < dead_cnt && trace->stream != NULL; i++)
+    {
+        it = hashmap_find(trace->objects, &candidates[i].ptr);
+        int dead = hashmap_not_end(it) && ((struct TracedObject *)it.value)->seq == candidates[i].seq;
+        if (dead)
+        {
+            uint64_t id = ((struct TracedObject *)it.value)->id;
+            write_event(trace, GC_EVENT_DEATH, 0, id, 0);
+            release_id(trace, id);
+        }
+        allow_writing(it);
+        if (dead)
+        {
+            hashmap_erase(trace->objects, &candidates[i].ptr);
+        }
+    }
+    pthread_mutex_unlock(&trace->lock);
+    free(candidates);
+}
+
+int alloc_trace_read_header(FILE *stream)
+{
+    char magic[sizeof(GC_ALLOC_TRACE_MAGIC) - 1];
+    return fread(magic, 1, sizeof(magic), stream) == sizeof(magic) && memcmp(magic, GC_ALLOC_TRACE_MAGIC, sizeof(magic)) == 0;
+}
+
+static int get_varint(FILE *stream, uint64_t *value)
+{
+    *value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7)
+    {
+        int c = getc(stream);
+        if (c == EOF)
+        {
+            return 0;
+        }
+        *value |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int alloc_trace_read_event(FILE *stream, struct AllocEvent *event)
+{
+    int c = getc(stream);
+    if (c == EOF)
+    {
+        return 0;
+    }
+    event->type = c & 0xf;
+    event->variant = c >> 4;
+    event->id = 0;
+    event->size = 0;
+
+    uint64_t thread, delta, size;
+    if (!get_varint(stream, &thread) || !get_varint(stream, &delta))
+    {
+        return 0;
+    }
+    event->thread = (unsigned)thread;
+    event->delta_ns = delta;
+    if (event->type != GC_EVENT_COLLECT && !get_varint(stream, &event->id))
+    {
+        return 0;
+    }
+    if (event->type == GC_EVENT_MALLOC || event->type == GC_EVENT_CALLOC || event->type == GC_EVENT_REALLOC)
+    {
+        if (!get_varint(stream, &size))
+        {
+            return 0;
+        }
+        event->size = size;
+    }
+    return event->type <= GC_EVENT_COLLECT;
+}
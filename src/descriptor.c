@@ -0,0 +1,56 @@
+#include "descriptor.h"
+
+#include <stdio.h>
+#include "safe_functions.h"
+
+struct GcDescriptor *gc_make_descriptor(size_t size, const size_t *offsets, size_t cnt)
+{
+    if (size == 0)
+    {
+        perror("gc_make_descriptor: empty type");
+        return NULL;
+    }
+    size_t words = (size + sizeof(void *) - 1) / sizeof(void *);
+    size_t bitmap_words = (words + GC_DESCRIPTOR_WORD_BITS - 1) / GC_DESCRIPTOR_WORD_BITS;
+    struct GcDescriptor *descriptor = safe_calloc(1, sizeof(struct GcDescriptor) + bitmap_words * sizeof(uint64_t));
+    descriptor->size = size;
+    descriptor->words = words;
+    for (size_t i = 0; i < cnt; i++)
+    {
+        if (offsets[i] % sizeof(void *) != 0 || offsets[i] + sizeof(void *) > size)
+        {
+            perror("gc_make_descriptor: misplaced pointer offset");
+            continue;
+        }
+        size_t word = offsets[i] / sizeof(void *);
+        descriptor->bitmap[word / GC_DESCRIPTOR_WORD_BITS] |= (uint64_t)1 << (word % GC_DESCRIPTOR_WORD_BITS);
+    }
+    return descriptor;
+}
+
+void gc_free_descriptor(struct GcDescriptor *descriptor)
+{
+    free(descriptor);
+}
+
+void descriptor_scan(const struct GcDescriptor *descriptor, const void *start, const void *end, const struct ScanRange *range, scan_visitor visit, void *ctx)
+{
+    size_t bitmap_words = (descriptor->words + GC_DESCRIPTOR_WORD_BITS - 1) / GC_DESCRIPTOR_WORD_BITS;
+    for (const char *element = start; element + descriptor->size <= (const char *)end; element += descriptor->size)
+    {
+        void *const *slots = (void *const *)element;
+        for (size_t w = 0; w < bitmap_words; w++)
+        {
+            uint64_t bits = descriptor->bitmap[w];
+            while (bits != 0)
+            {
+                void *ptr = slots[w * GC_DESCRIPTOR_WORD_BITS + __builtin_ctzll(bits)];
+                if ((uintptr_t)ptr >= range->low && (uintptr_t)ptr < range->high)
+                {
+                    visit(ptr, ctx);
+                }
+                bits &= bits - 1;
+            }
+        }
+    }
+}
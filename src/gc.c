@@ -2,11 +2,15 @@
 #include "global.h"
 #include "safe_functions.h"
 #include "sched.h"
+#include "trace.h"
+#include <limits.h>
 #include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 unsigned hash_for_pointer(const void *value)
 {
@@ -15,33 +19,143 @@ unsigned hash_for_pointer(const void *value)
 
 unsigned hash_for_thread(const void *value)
 {
-    return (unsigned)(pthread_t *)value;
+    return (unsigned)*(const pthread_t *)value;
+}
+
+static unsigned gc_generation = 0;
+static __thread struct ThreadState *thread_state = NULL;
+static __thread unsigned thread_state_generation = 0;
+
+static struct ThreadState *current_thread_state()
+{
+    return thread_state_generation == gc_generation ? thread_state : NULL;
+}
+
+static unsigned long now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+// Start of a phase on the calling thread, for timing the phases of a cycle
+// one after another and, with performance counters on, counting them.
+struct PhaseClock
+{
+    unsigned long ns;
+    uint64_t counts[PERF_COUNTER_CNT];
+};
+
+static const struct PerfCounters *thread_counters()
+{
+    struct ThreadState *state = current_thread_state();
+    return gc->perf_counters && state != NULL && atomic_load(&state->perf_open) ? &state->perf : NULL;
+}
+
+static void phase_start(struct PhaseClock *clock, unsigned long now)
+{
+    clock->ns = now;
+    const struct PerfCounters *counters = thread_counters();
+    if (counters != NULL)
+    {
+        perf_counters_read(counters, clock->counts);
+    }
+    else
+    {
+        // the clock lives on a stack that gets scanned
+        memset(clock->counts, 0, sizeof(clock->counts));
+    }
+}
+
+// Adds what the counters counted since clock started to phase, restarts
+// the clock and returns the time since it started. The phase may be
+// counted by several threads at once.
+static unsigned long phase_lap(struct PhaseClock *clock, enum CounterPhase phase)
+{
+    unsigned long now = now_ns();
+    unsigned long elapsed = now - clock->ns;
+    clock->ns = now;
+
+    const struct PerfCounters *counters = thread_counters();
+    if (counters != NULL)
+    {
+        uint64_t counts[PERF_COUNTER_CNT];
+        perf_counters_read(counters, counts);
+        for (int i = 0; i < PERF_COUNTER_CNT; i++)
+        {
+            __atomic_fetch_add(&gc->cycle.counters[phase][i], counts[i] - clock->counts[i], __ATOMIC_RELAXED);
+            clock->counts[i] = counts[i];
+        }
+    }
+    return elapsed;
+}
+
+static struct ThreadState *iterator_state(struct Iterator it)
+{
+    return *(struct ThreadState **)it.value;
+}
+
+// A thread stopped in the signal handler must not hold the roots lock, so
+// the signal is held off while it is taken.
+static void block_scan_signal(sigset_t *old)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, old);
+}
+
+static void restore_scan_signal(const sigset_t *old)
+{
+    pthread_sigmask(SIG_SETMASK, old, NULL);
+}
+
+void gc_add_roots(void *start, void *end)
+{
+    sigset_t old;
+    block_scan_signal(&old);
+    roots_add(&gc->roots, start, end);
+    restore_scan_signal(&old);
+}
+
+void gc_remove_roots(void *start, void *end)
+{
+    sigset_t old;
+    block_scan_signal(&old);
+    roots_remove(&gc->roots, start, end);
+    restore_scan_signal(&old);
+}
+
+void gc_exclude_range(void *start, void *end)
+{
+    sigset_t old;
+    block_scan_signal(&old);
+    roots_exclude(&gc->roots, start, end);
+    restore_scan_signal(&old);
 }
 
 void gc_activate(void *ptr)
 {
-    struct Iterator it = hashmap_find(gc->allocations, &ptr);
-    if (it.value == NULL)
+    struct Block *block;
+    unsigned index;
+    if (!heap_find_object(&gc->heap, ptr, &block, &index))
     {
         perror("gc_activate: pointer not found");
         return;
     }
-    struct Allocation *alloc = *(struct Allocation **)it.value;
-    allow_writing(it);
-    alloc->active = 1;
+    __atomic_fetch_or(&block->flags[index], GC_FLAG_ACTIVE, __ATOMIC_RELAXED);
 }
 
 void gc_deactivate(void *ptr)
 {
-    struct Iterator it = hashmap_find(gc->allocations, &ptr);
-    if (it.value == NULL)
+    struct Block *block;
+    unsigned index;
+    if (!heap_find_object(&gc->heap, ptr, &block, &index))
     {
         perror("gc_deactivate: pointer not found");
         return;
     }
-    struct Allocation *alloc = *(struct Allocation **)it.value;
-    allow_writing(it);
-    alloc->active = 0;
+    __atomic_fetch_and(&block->flags[index], (unsigned char)~GC_FLAG_ACTIVE, __ATOMIC_RELAXED);
 }
 
 void gc_create()
@@ -53,13 +167,60 @@ void gc_create()
     sigaddset(&set, SIGUSR1);
     pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 
+    scan_init();
+
     gc = safe_malloc(sizeof(struct GarbageCollector));
 
-    gc->allocations = hashmap_create(sizeof(void *), sizeof(void *), hash_for_pointer);
-    gc->threads = hashmap_create(sizeof(pthread_t), 0, hash_for_thread);
+    heap_init(&gc->heap);
+    cache_init(&gc->heap);
+    mark_pool_init(&gc->mark_pool, &gc->heap, 1);
+    barrier_install(&gc->heap);
+    gc->threads = hashmap_create(sizeof(pthread_t), sizeof(struct ThreadState *), hash_for_thread);
+    roots_init(&gc->roots);
+    gc_generation++;
 
     gc->paused = 0;
-    gc->allocation_threshold = 1000;
+    gc->allocation_threshold = 0;
+    gc->allocated_bytes = 0;
+    gc->trigger_bytes = GC_MIN_HEAP;
+    gc->live_bytes = 0;
+    gc->heap_growth = GC_HEAP_GROWTH;
+    gc->min_heap = GC_MIN_HEAP;
+    gc->max_heap = SIZE_MAX;
+    gc->cycle_start_ns = 0;
+    gc->cycle_end_ns = now_ns();
+    gc->last_mark_ns = 0;
+    gc->allocated_objects = 0;
+    memset(&gc->cycle, 0, sizeof(gc->cycle));
+    stats_init(&gc->stats);
+    gc->stopped_ns = 0;
+    gc->log = NULL;
+    alloc_trace_init(&gc->alloc_trace);
+    gc->perf_counters = 0;
+    gc->counters_available = 0;
+    gc->unaligned_scan = 0;
+    gc->mark_stack_limit = GC_MARK_STACK_LIMIT;
+    gc->mark_overflowed = 0;
+    gc->world_stopped = 0;
+    gc->world_epoch = 0;
+    gc->donate_roots = 0;
+    gc->concurrent = 0;
+    gc->generational = 0;
+    gc->soft_dirty = 0;
+    gc->tracking = 0;
+    gc->minor_cnt = 0;
+    gc->major_interval = GC_MAJOR_INTERVAL;
+    gc->phase = GC_PHASE_IDLE;
+    gc->incremental_budget = 0;
+    gc->background_sweep = 0;
+    gc->claimed = NULL;
+    gc->safepoint_requested = 0;
+    gc->safepoint_wait_ns = 0;
+    gc->safepoint_arrival = 0;
+    gc->last_time_to_safepoint = 0;
+    gc->max_time_to_safepoint = 0;
+    gc->stack_watermark = 1;
+    gc->stack_bytes_reused = 0;
     gc->threads_to_scan = 0;
     gc->allocation_cnt = 0;
     gc->threads_registring = 0;
@@ -70,19 +231,36 @@ void gc_create()
 
 void gc_destruct()
 {
-    struct Iterator it = hashmap_begin(gc->allocations);
+    if (gc->background_sweep)
+    {
+        sweeper_destruct(&gc->sweeper);
+    }
+    mark_pool_destruct(&gc->mark_pool);
+    if (gc->phase == GC_PHASE_MARK)
+    {
+        marker_destruct(&gc->incremental);
+    }
+    if (gc->heap.track_dirty)
+    {
+        barrier_disarm(&gc->heap);
+    }
+    soft_dirty_destruct();
+    barrier_uninstall();
+    cache_destruct(&gc->heap);
+    heap_destruct(&gc->heap);
 
+    struct Iterator it = hashmap_begin(gc->threads);
     while (hashmap_not_end(it))
     {
-        struct Allocation *alloc = *(struct Allocation **)it.value;
-        free(alloc->ptr);
-        free(alloc);
+        watermark_destruct(&iterator_state(it)->watermark);
+        perf_counters_close(&iterator_state(it)->perf);
+        free(iterator_state(it));
         it = hashmap_next(it);
     }
     allow_writing(it);
-    hashmap_destruct(gc->allocations);
-
     hashmap_destruct(gc->threads);
+    roots_destruct(&gc->roots);
+    alloc_trace_destruct(&gc->alloc_trace);
 
     pthread_mutex_destroy(&gc->collect_garbage_mutex);
 
@@ -90,88 +268,187 @@ void gc_destruct()
     gc = NULL;
 }
 
-void *gc_malloc(size_t size)
+static void *try_allocate(size_t size, enum ObjectKind kind)
 {
-    struct Allocation *alloc = malloc(sizeof(struct Allocation));
-    if (alloc == NULL)
+    if (size > GC_MAX_SMALL_SIZE)
     {
-        collect_garbage();
-        alloc = malloc(sizeof(struct Allocation));
-        if (alloc == NULL)
-        {
-            perror("gc_malloc: out of memory");
-            return NULL;
-        }
+        return heap_alloc(&gc->heap, size, kind);
+    }
+    return cache_alloc(&gc->heap, cache_get(&gc->heap), heap_size_class(size, kind));
+}
+
+// Collections the collector starts itself, which unlike collect_garbage()
+// do not show up in an allocation trace.
+static void collect_default();
+
+static void *allocate(size_t size, enum ObjectKind kind)
+{
+    void *ptr = try_allocate(size, kind);
+    if (ptr == NULL)
+    {
+        collect_default();
+        ptr = try_allocate(size, kind);
+    }
+    return ptr;
+}
+
+static void release(struct Block *block, unsigned index)
+{
+    if (block->size_class == GC_LARGE_CLASS)
+    {
+        heap_free(&gc->heap, block, index);
     }
-    alloc->ptr = malloc(size);
-    if (alloc->ptr == NULL)
+    else
     {
-        collect_garbage();
-        alloc->ptr = malloc(size);
-        if (alloc->ptr == NULL)
-        {
-            perror("gc_malloc: out of memory");
-            free(alloc);
-            return NULL;
-        }
+        cache_free(&gc->heap, cache_get(&gc->heap), block, index);
     }
-    alloc->size = size;
-    alloc->active = 1;
+}
 
-    hashmap_insert(gc->allocations, &alloc->ptr, &alloc);
+// Allocations are counted per thread and added to the shared counters in
+// batches, so that the allocation path does not bounce their cache lines.
+// Large allocations flush the batch at once.
+static __thread unsigned unreported_allocations = 0;
+static __thread size_t unreported_bytes = 0;
+
+// With an allocation threshold set, a collection starts after that many
+// allocations. Otherwise the trigger is the number of bytes allocated since
+// the last cycle, which update_trigger() derives from the live heap.
+static int over_trigger(unsigned cnt, size_t bytes)
+{
+    int over_cnt = atomic_fetch_add(&gc->allocation_cnt, cnt) + cnt > gc->allocation_threshold;
+    int over_bytes = atomic_fetch_add(&gc->allocated_bytes, bytes) + bytes > gc->trigger_bytes;
+    atomic_fetch_add(&gc->allocated_objects, cnt);
+    return gc->allocation_threshold != 0 ? over_cnt : over_bytes;
+}
 
-    if (atomic_fetch_add(&gc->allocation_cnt, 1) > gc->allocation_threshold && !gc->paused)
+static void after_allocation(void *ptr, size_t size)
+{
+    unreported_bytes += size;
+    // an allocation threshold counts single allocations, so nothing is held
+    // back while one is set
+    if (++unreported_allocations < GC_CACHE_BATCH && unreported_bytes < GC_BYTES_BATCH && gc->allocation_threshold == 0)
+    {
+        return;
+    }
+    unsigned cnt = unreported_allocations;
+    size_t bytes = unreported_bytes;
+    unreported_allocations = 0;
+    unreported_bytes = 0;
+    if (over_trigger(cnt, bytes) && !gc->paused)
     {
         // this pointer can be destroyed, because it is not used anywhere yet, so we put it in stack
-        void *last_alloc = alloc->ptr;
-        
-        collect_garbage();
-        atomic_store(&gc->allocation_cnt, 0);
+        void *volatile last_alloc = ptr;
+
+        if (gc->incremental_budget == 0)
+        {
+            collect_default();
+            atomic_store(&gc->allocation_cnt, 0);
+        }
+        else if (gc_collect_step(gc->incremental_budget) == GC_PHASE_IDLE)
+        {
+            atomic_store(&gc->allocation_cnt, 0);
+        }
+    }
+}
+
+void *gc_malloc(size_t size)
+{
+    void *ptr = allocate(size, GC_KIND_NORMAL);
+    if (ptr == NULL)
+    {
+        perror("gc_malloc: out of memory");
+        return NULL;
     }
+    alloc_trace_allocate(&gc->alloc_trace, GC_EVENT_MALLOC, GC_KIND_NORMAL, ptr, size);
 
-    return alloc->ptr;
+    after_allocation(ptr, size);
+
+    return ptr;
 }
 
 void *gc_calloc(size_t nmemb, size_t size)
 {
-    struct Allocation *alloc = malloc(sizeof(struct Allocation));
-    if (alloc == NULL)
+    if (size != 0 && nmemb > SIZE_MAX / size)
     {
-        collect_garbage();
-        alloc = malloc(sizeof(struct Allocation));
-        if (alloc == NULL)
-        {
-            perror("gc_calloc: out of memory");
-            return NULL;
-        }
+        perror("gc_calloc: size overflow");
+        return NULL;
     }
-    alloc->ptr = calloc(nmemb, size);
-    if (alloc->ptr == NULL)
+
+    void *ptr = allocate(nmemb * size, GC_KIND_NORMAL);
+    if (ptr == NULL)
     {
-        collect_garbage();
-        alloc->ptr = calloc(nmemb, size);
-        if (alloc->ptr == NULL)
-        {
-            perror("gc_calloc: out of memory");
-            free(alloc);
-            return NULL;
-        }
+        perror("gc_calloc: out of memory");
+        return NULL;
     }
+    memset(ptr, 0, nmemb * size);
+    alloc_trace_allocate(&gc->alloc_trace, GC_EVENT_CALLOC, GC_KIND_NORMAL, ptr, nmemb * size);
+
+    after_allocation(ptr, nmemb * size);
 
-    alloc->size = nmemb * size;
-    alloc->active = 1;
-    hashmap_insert(gc->allocations, &alloc->ptr, &alloc);
+    return ptr;
+}
 
-    if (atomic_fetch_add(&gc->allocation_cnt, 1) > gc->allocation_threshold && !gc->paused)
+void *gc_malloc_atomic(size_t size)
+{
+    void *ptr = allocate(size, GC_KIND_POINTER_FREE);
+    if (ptr == NULL)
     {
-        // this pointer can be destroyed, because it is not used anywhere yet, so we put it in stack
-        void *last_alloc = alloc->ptr;
+        perror("gc_malloc_atomic: out of memory");
+        return NULL;
+    }
+    alloc_trace_allocate(&gc->alloc_trace, GC_EVENT_MALLOC, GC_KIND_POINTER_FREE, ptr, size);
+
+    after_allocation(ptr, size);
+
+    return ptr;
+}
+
+void *gc_calloc_atomic(size_t nmemb, size_t size)
+{
+    if (size != 0 && nmemb > SIZE_MAX / size)
+    {
+        perror("gc_calloc_atomic: size overflow");
+        return NULL;
+    }
+
+    void *ptr = allocate(nmemb * size, GC_KIND_POINTER_FREE);
+    if (ptr == NULL)
+    {
+        perror("gc_calloc_atomic: out of memory");
+        return NULL;
+    }
+    memset(ptr, 0, nmemb * size);
+    alloc_trace_allocate(&gc->alloc_trace, GC_EVENT_CALLOC, GC_KIND_POINTER_FREE, ptr, nmemb * size);
+
+    after_allocation(ptr, nmemb * size);
 
-        collect_garbage();
-        atomic_store(&gc->allocation_cnt, 0);
+    return ptr;
+}
+
+static void set_descriptor(void *ptr, const struct GcDescriptor *descriptor)
+{
+    struct Block *block;
+    unsigned index;
+    if (heap_resolve(&gc->heap, ptr, &block, &index))
+    {
+        __atomic_store_n(&block->descriptors[index], descriptor, __ATOMIC_RELEASE);
+    }
+}
+
+void *gc_malloc_typed(size_t size, const struct GcDescriptor *descriptor)
+{
+    void *ptr = allocate(size, GC_KIND_TYPED);
+    if (ptr == NULL)
+    {
+        perror("gc_malloc_typed: out of memory");
+        return NULL;
     }
+    set_descriptor(ptr, descriptor);
+    alloc_trace_allocate(&gc->alloc_trace, GC_EVENT_MALLOC, GC_KIND_TYPED, ptr, size);
+
+    after_allocation(ptr, size);
 
-    return alloc->ptr;
+    return ptr;
 }
 
 void *gc_realloc(void *ptr, size_t size)
@@ -180,126 +457,144 @@ void *gc_realloc(void *ptr, size_t size)
     {
         return gc_malloc(size);
     }
-    struct Iterator it = hashmap_find(gc->allocations, &ptr);
-    if (it.value == NULL)
+    struct Block *block;
+    unsigned index;
+    if (!heap_find_object(&gc->heap, ptr, &block, &index))
     {
         perror("gc_realloc: pointer not found");
         return NULL;
     }
-    struct Allocation *alloc = *(struct Allocation **)it.value;
-    allow_writing(it);
-    hashmap_erase(gc->allocations, &ptr);
-    alloc->ptr = realloc(alloc->ptr, size);
-    if (alloc->ptr == NULL)
+
+    size_t old_size = block->object_size;
+    if (block->size_class != GC_LARGE_CLASS && size <= old_size)
     {
-        collect_garbage();
-        alloc->ptr = realloc(alloc->ptr, size);
-        if (alloc->ptr == NULL)
-        {
-            perror("gc_realloc: out of memory");
-            free(alloc);
-            return NULL;
-        }
+        alloc_trace_realloc(&gc->alloc_trace, ptr, ptr, block->kind, size);
+        return ptr;
     }
-    alloc->size = size;
-    hashmap_insert(gc->allocations, &alloc->ptr, &alloc);
 
-    if (atomic_fetch_add(&gc->allocation_cnt, 1) > gc->allocation_threshold && !gc->paused)
+    void *new_ptr = allocate(size, block->kind);
+    if (new_ptr == NULL)
     {
-        // this pointer can be destroyed, because it is not used anywhere yet, so we put it in stack
-        void *last_alloc = alloc->ptr;
-
-        collect_garbage();
-        atomic_store(&gc->allocation_cnt, 0);
+        perror("gc_realloc: out of memory");
+        return NULL;
+    }
+    if (block->kind == GC_KIND_TYPED)
+    {
+        set_descriptor(new_ptr, block->descriptors[index]);
     }
+    memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+    alloc_trace_realloc(&gc->alloc_trace, ptr, new_ptr, block->kind, size);
+    release(block, index);
+
+    after_allocation(new_ptr, size);
 
-    return alloc->ptr;
+    return new_ptr;
 }
 
 void gc_free(void *ptr)
 {
-    struct Iterator it = hashmap_find(gc->allocations, &ptr);
-    if (it.value == NULL)
+    struct Block *block;
+    unsigned index;
+    if (!heap_find_object(&gc->heap, ptr, &block, &index))
     {
         perror("gc_free: pointer not found");
         return;
     }
-    struct Allocation *alloc = *(struct Allocation **)it.value;
-    allow_writing(it);
-    hashmap_erase(gc->allocations, &ptr);
-    fflush(stdout);
-    free(alloc->ptr);
-    free(alloc);
-    fflush(stdout);
+    // before the memory can be handed out again
+    alloc_trace_free(&gc->alloc_trace, ptr);
+    release(block, index);
+}
+
+pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t gc_cond = PTHREAD_COND_INITIALIZER;
+
+static int out_of_time(const struct timespec *start, unsigned long budget_ns)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    unsigned long elapsed = (now.tv_sec - start->tv_sec) * 1000000000UL + now.tv_nsec - start->tv_nsec;
+    return elapsed >= budget_ns;
 }
 
-void gc_dfs(struct Allocation *alloc)
+// Records when the last thread reached its safepoint. Async-signal-safe.
+static void record_arrival()
 {
-    if (alloc->used)
+    unsigned long now = now_ns();
+    unsigned long seen = __atomic_load_n(&gc->safepoint_arrival, __ATOMIC_RELAXED);
+    while (seen < now && !__atomic_compare_exchange_n(&gc->safepoint_arrival, &seen, now, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
     {
-        return;
     }
-    alloc->used = 1;
-    void *start = alloc->ptr;
-    void *end = start + alloc->size;
-    for (void *i = start; i < end; i += 8)
+}
+
+// Markers run in the signal handler too, so the count is added atomically.
+static void count_scanned(size_t bytes)
+{
+    __atomic_fetch_add(&gc->cycle.scanned_words, bytes / sizeof(void *), __ATOMIC_RELAXED);
+}
+
+static void finish_marker(struct Marker *marker)
+{
+    if (gc->donate_roots)
+    {
+        mark_pool_donate(&gc->mark_pool, marker);
+    }
+    else
     {
-        void *ptr = *(void **)i;
-        if (hashmap_contains(gc->allocations, &ptr))
-        {
-            struct Iterator it = hashmap_find(gc->allocations, &ptr);
-            struct Allocation *alloc = *(struct Allocation **)it.value;
-            allow_writing(it);
-            if (alloc->active && !alloc->root)
-            {
-                gc_dfs(alloc);
-            }
-        }
+        marker_drain(marker);
+    }
+    if (marker->overflowed)
+    {
+        atomic_store(&gc->mark_overflowed, 1);
     }
+    count_scanned(marker->scanned);
+    marker_destruct(marker);
 }
 
-pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t gc_cond = PTHREAD_COND_INITIALIZER;
+static void mark_range(void *start, void *end)
+{
+    struct Marker marker;
+    marker_init(&marker, &gc->heap, gc->mark_stack_limit, gc->unaligned_scan);
+    marker_scan_roots(&marker, start, end);
+    finish_marker(&marker);
+}
+
+static void scan_stack(struct ThreadState *state, void *top, void *base)
+{
+    if (state == NULL || !gc->stack_watermark || gc->unaligned_scan)
+    {
+        mark_range(top, base);
+        return;
+    }
+
+    struct Marker marker;
+    marker_init(&marker, &gc->heap, gc->mark_stack_limit, gc->unaligned_scan);
+    watermark_scan(&state->watermark, &marker, top, base);
+    atomic_fetch_add(&gc->stack_bytes_reused, state->watermark.reused);
+    finish_marker(&marker);
+}
 
 void mark_stack()
 {
+    unsigned long start = trace_begin(TRACE_MARK_STACK);
+    struct PhaseClock clock;
+    phase_start(&clock, now_ns());
+    // setjmp() leaves the signal mask part of the buffer alone, and stale
+    // pointers in it would be scanned with the rest of the frame
     jmp_buf buf;
+    memset(buf, 0, sizeof(buf));
     int ret = setjmp(buf);
 
+    // Bounds are captured at registration; only unregistered callers pay
+    // for looking them up.
+    struct ThreadState *state = current_thread_state();
     void *top = get_stack_top();
-    void *bottom = get_stack_base();
+    void *bottom = state != NULL ? state->stack_base : get_stack_base();
     if (top < bottom)
-        for (void *i = top; i <= bottom - sizeof(void *); i += 1)
-        {
-            void *ptr = *(void **)i;
-            if (hashmap_contains(gc->allocations, &ptr))
-            {
-                struct Iterator it = hashmap_find(gc->allocations, &ptr);
-                struct Allocation *alloc = *(struct Allocation **)it.value;
-                allow_writing(it);
-                if (alloc->active)
-                {
-                    alloc->root = 1;
-                    gc_dfs(alloc);
-                }
-            }
-        }
+        scan_stack(state, top, bottom);
     else
-        for (void *i = bottom; i <= top - sizeof(void *); i += 1)
-        {
-            void *ptr = *(void **)i;
-            if (hashmap_contains(gc->allocations, &ptr))
-            {
-                struct Iterator it = hashmap_find(gc->allocations, &ptr);
-                struct Allocation *alloc = *(struct Allocation **)it.value;
-                allow_writing(it);
-                if (alloc->active)
-                {
-                    alloc->root = 1;
-                    gc_dfs(alloc);
-                }
-            }
-        }
+        mark_range(bottom, top);
+    phase_lap(&clock, GC_COUNT_MARK_STACK);
+    trace_end(TRACE_MARK_STACK, start);
 
     atomic_fetch_sub(&gc->threads_to_scan, 1);
 
@@ -308,127 +603,598 @@ void mark_stack()
     pthread_mutex_unlock(&gc_mutex);
 }
 
+static void mark_root_range(void *start, void *end, void *ctx)
+{
+    (void)ctx;
+    mark_range(start, end);
+}
+
 void mark_sections()
 {
-    void *top = get_data_start();
-    void *bottom = get_data_end();
-    for (void *i = top; i <= bottom - sizeof(void *); i += 1)
+    unsigned long start = trace_begin(TRACE_MARK_SECTIONS);
+    roots_for_each(&gc->roots, mark_root_range, NULL);
+    trace_end(TRACE_MARK_SECTIONS, start);
+}
+
+static void mark_dirty_pages()
+{
+    struct Marker marker;
+    marker_init(&marker, &gc->heap, gc->mark_stack_limit, gc->unaligned_scan);
+    marker_rescan_dirty(&marker);
+    finish_marker(&marker);
+}
+
+static void trace()
+{
+    unsigned long start = trace_begin(TRACE_MARK);
+    if (gc->donate_roots)
     {
-        void *ptr = *(void **)i;
-        if (hashmap_contains(gc->allocations, &ptr))
+        if (mark_pool_run(&gc->mark_pool, gc->mark_stack_limit, gc->unaligned_scan))
         {
-            struct Iterator it = hashmap_find(gc->allocations, &ptr);
-            struct Allocation *alloc = *(struct Allocation **)it.value;
-            allow_writing(it);
-            if (alloc->active)
-            {
-                alloc->root = 1;
-                gc_dfs(alloc);
-            }
+            atomic_store(&gc->mark_overflowed, 1);
         }
+        count_scanned(gc->mark_pool.scanned);
     }
+    trace_end(TRACE_MARK, start);
+}
 
-    top = get_bss_start();
-    bottom = get_bss_end();
-    for (void *i = top; i <= bottom - sizeof(void *); i += 1)
+// Requires the heap lock, like the sweep that follows it.
+static void recover_overflow()
+{
+    if (!atomic_exchange(&gc->mark_overflowed, 0))
     {
-        void *ptr = *(void **)i;
-        if (hashmap_contains(gc->allocations, &ptr))
-        {
-            struct Iterator it = hashmap_find(gc->allocations, &ptr);
-            struct Allocation *alloc = *(struct Allocation **)it.value;
-            allow_writing(it);
-            if (alloc->active)
-            {
-                alloc->root = 1;
-                gc_dfs(alloc);
-            }
-        }
+        return;
     }
+
+    struct Marker marker;
+    marker_init(&marker, &gc->heap, gc->mark_stack_limit, gc->unaligned_scan);
+    marker.overflowed = 1;
+    marker_rescan_heap(&marker);
+    count_scanned(marker.scanned);
+    marker_destruct(&marker);
 }
 
 void sweep()
 {
-    struct HashMap *to_sweep = hashmap_create(sizeof(void *), sizeof(void *), hash_for_pointer);
-    struct Iterator it = hashmap_begin(gc->allocations);
-    while (hashmap_not_end(it))
+    pthread_mutex_lock(&gc->heap.lock);
+    heap_sweep(&gc->heap);
+    pthread_mutex_unlock(&gc->heap.lock);
+}
+
+// Keeps live plus allowance within the heap limits, leaving at least
+// GC_MIN_ALLOWANCE to allocate.
+static size_t clamp_allowance(size_t live, size_t allowance)
+{
+    if (live + allowance < gc->min_heap)
     {
-        struct Allocation *alloc = *(struct Allocation **)it.value;
-        if (!alloc->used && alloc->active)
-        {
-            hashmap_insert(to_sweep, &alloc->ptr, &alloc);
-        }
-        it = hashmap_next(it);
+        allowance = gc->min_heap - live;
     }
-    allow_writing(it);
-
-    it = hashmap_begin(to_sweep);
-    while (hashmap_not_end(it))
+    if (live > gc->max_heap || allowance > gc->max_heap - live)
     {
-        struct Allocation *alloc = *(struct Allocation **)it.value;
-        hashmap_erase(gc->allocations, &alloc->ptr);
-        free(alloc->ptr);
-        free(alloc);
-        it = hashmap_next(it);
+        allowance = live < gc->max_heap ? gc->max_heap - live : 0;
     }
-    allow_writing(it);
-    hashmap_destruct(to_sweep);
+    return allowance < GC_MIN_ALLOWANCE ? GC_MIN_ALLOWANCE : allowance;
 }
 
-void collect_garbage()
+// Called at the end of every mark with the heap lock held. The next cycle
+// starts once the heap has grown by heap_growth percent of what is live
+// now, within the heap limits. When marking took more than GC_MARK_SHARE
+// percent of the time since the previous cycle, the allowance is stretched
+// in proportion, by up to GC_MAX_STRETCH times, so that expensive marks
+// run less often.
+static void update_trigger(size_t live)
 {
-    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    unsigned long now = now_ns();
+    unsigned long mark_ns = now - gc->cycle_start_ns;
+    unsigned long mutator_ns = gc->cycle_start_ns > gc->cycle_end_ns ? gc->cycle_start_ns - gc->cycle_end_ns : 0;
+    gc->last_mark_ns = mark_ns;
+    gc->cycle_end_ns = now;
 
-    struct Iterator it = hashmap_begin(gc->allocations);
-    while (hashmap_not_end(it))
+    gc->live_bytes = live;
+
+    size_t allowance = live / 100 * gc->heap_growth;
+    if (mark_ns * 100 > (unsigned long)GC_MARK_SHARE * mutator_ns)
     {
-        struct Allocation *alloc = *(struct Allocation **)it.value;
-        alloc->root = 0;
-        alloc->used = 0;
-        it = hashmap_next(it);
+        unsigned long stretch = mutator_ns == 0 ? GC_MAX_STRETCH : mark_ns * 100 / (GC_MARK_SHARE * mutator_ns);
+        allowance *= stretch < GC_MAX_STRETCH ? stretch : GC_MAX_STRETCH;
     }
-    allow_writing(it);
+    gc->trigger_bytes = clamp_allowance(live, allowance);
+    atomic_store(&gc->allocated_bytes, 0);
+}
 
-    mark_sections();
+// Sweeps what the previous cycle left. Requires the heap lock.
+static void finish_sweep()
+{
+    unsigned long start = trace_begin(TRACE_SWEEP);
+    heap_sweep_step(&gc->heap, SIZE_MAX, NULL);
+    trace_end(TRACE_SWEEP, start);
+}
 
-    pthread_t self = pthread_self();
-    atomic_store(&gc->threads_to_scan, gc->threads->size);
-    if (hashmap_contains(gc->threads, &self))
+// Queues the heap for sweeping once marking is over. Requires the heap lock
+// and, for the thread caches, the world still stopped.
+static void begin_sweep()
+{
+    struct GcCycleStats *cycle = &gc->cycle;
+    // the free cells in thread caches are marked to keep them from the
+    // sweep and count as objects of the heap, but hold nothing
+    size_t cached_cells;
+    size_t cached = cache_cell_bytes(&gc->heap, &cached_cells);
+    size_t marked_objects;
+    size_t marked = heap_marked_bytes(&gc->heap, &marked_objects);
+    size_t live = marked > cached ? marked - cached : 0;
+    size_t objects = gc->heap.object_cnt > cached_cells ? gc->heap.object_cnt - cached_cells : 0;
+    size_t object_bytes = gc->heap.object_bytes > cached ? gc->heap.object_bytes - cached : 0;
+    cycle->marked_bytes = live;
+    cycle->marked_objects = marked_objects > cached_cells ? marked_objects - cached_cells : 0;
+    cycle->allocated_bytes = atomic_load(&gc->allocated_bytes);
+    cycle->allocated_objects = atomic_exchange(&gc->allocated_objects, 0);
+    // everything unmarked goes in this sweep, the previous one being over
+    cycle->freed_bytes = object_bytes > live ? object_bytes - live : 0;
+    cycle->freed_objects = objects > cycle->marked_objects ? objects - cycle->marked_objects : 0;
+
+    update_trigger(live);
+    alloc_trace_mark_done(&gc->alloc_trace);
+    heap_sweep_begin(&gc->heap);
+    if (gc->background_sweep)
     {
-        mark_stack();
+        sweeper_wake(&gc->sweeper);
     }
+}
 
-    pthread_mutex_lock(&gc_mutex);
+// Gives threads polling gc_safepoint() the chance to park in a blocking
+// region before the rest of them are signalled. Requires gc_mutex.
+static void wait_for_safepoints(pthread_t self)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    atomic_store(&gc->safepoint_requested, 1);
 
-    while (atomic_load(&gc->threads_registring) != 0)
-    {
-        sched_yield();
-    }
-    it = hashmap_begin(gc->threads);
-    while (hashmap_not_end(it))
+    for (;;)
     {
-        pthread_t thread = *(pthread_t *)it.key;
-        if (thread != self)
+        int running = 0;
+        struct Iterator it = hashmap_begin(gc->threads);
+        while (hashmap_not_end(it))
         {
-            if (pthread_kill(thread, SIGUSR1) != 0)
+            struct ThreadState *state = iterator_state(it);
+            if (state->thread != self && atomic_load(&state->mode) == GC_THREAD_RUNNING)
             {
-                perror("pthread_kill failed");
-                atomic_fetch_sub(&gc->threads_to_scan, 1);
+                running++;
             }
+            it = hashmap_next(it);
         }
-        it = hashmap_next(it);
-    }
-    allow_writing(it);
+        allow_writing(it);
 
-    while (atomic_load(&gc->threads_to_scan))
-    {
-        pthread_cond_wait(&gc_cond, &gc_mutex);
+        if (running == 0 || out_of_time(&start, gc->safepoint_wait_ns))
+        {
+            return;
+        }
+        sched_yield();
     }
+}
+
+static void scan_claimed(struct ThreadState *state)
+{
+    scan_stack(state, state->stack_top, state->stack_base);
+    mark_range(&state->regs, (char *)&state->regs + sizeof(state->regs));
+}
+
+static void release_claimed()
+{
+    while (gc->claimed != NULL)
+    {
+        struct ThreadState *state = gc->claimed;
+        gc->claimed = state->claimed_next;
+        atomic_store(&state->mode, GC_THREAD_BLOCKING);
+    }
+}
+
+// Makes every registered thread scan its own stack, except for threads in
+// a blocking region, whose published stacks the collector scans itself.
+// With stop set the threads stay parked in the signal handler, or in their
+// blocking region, until start_world().
+static void scan_thread_stacks(int stop)
+{
+    unsigned long trace_start = trace_begin(TRACE_SCAN_THREADS);
+    atomic_store(&gc->world_stopped, stop);
+
+    pthread_t self = pthread_self();
+    int registered = 0;
+    unsigned long start = now_ns();
+    __atomic_store_n(&gc->safepoint_arrival, start, __ATOMIC_RELAXED);
+    if (stop)
+    {
+        gc->stopped_ns = start;
+    }
+
+    pthread_mutex_lock(&gc_mutex);
+
+    while (atomic_load(&gc->threads_registring) != 0)
+    {
+        sched_yield();
+    }
+    if (stop && gc->safepoint_wait_ns != 0)
+    {
+        wait_for_safepoints(self);
+    }
+    // The count is taken while the map is locked so that a thread
+    // registering concurrently is either signalled and counted or neither.
+    struct Iterator it = hashmap_begin(gc->threads);
+    atomic_store(&gc->threads_to_scan, gc->threads->size);
+    while (hashmap_not_end(it))
+    {
+        struct ThreadState *state = iterator_state(it);
+        int blocking = GC_THREAD_BLOCKING;
+        if (state->thread == self)
+        {
+            registered = 1;
+        }
+        else if (atomic_compare_exchange_strong(&state->mode, &blocking, GC_THREAD_CLAIMED))
+        {
+            state->claimed_next = gc->claimed;
+            gc->claimed = state;
+            atomic_fetch_sub(&gc->threads_to_scan, 1);
+        }
+        else if (pthread_kill(state->thread, SIGUSR1) != 0)
+        {
+            perror("pthread_kill failed");
+            atomic_fetch_sub(&gc->threads_to_scan, 1);
+        }
+        it = hashmap_next(it);
+    }
+    allow_writing(it);
 
     pthread_mutex_unlock(&gc_mutex);
 
-    sweep();
+    for (struct ThreadState *state = gc->claimed; state != NULL; state = state->claimed_next)
+    {
+        scan_claimed(state);
+    }
+    if (!stop)
+    {
+        release_claimed();
+    }
+    if (registered)
+    {
+        mark_stack();
+    }
+
+    pthread_mutex_lock(&gc_mutex);
+    while (atomic_load(&gc->threads_to_scan))
+    {
+        pthread_cond_wait(&gc_cond, &gc_mutex);
+    }
+    pthread_mutex_unlock(&gc_mutex);
+
+    if (stop)
+    {
+        gc->last_time_to_safepoint = __atomic_load_n(&gc->safepoint_arrival, __ATOMIC_RELAXED) - start;
+        gc->cycle.stop_ns = gc->last_time_to_safepoint;
+        if (gc->last_time_to_safepoint > gc->max_time_to_safepoint)
+        {
+            gc->max_time_to_safepoint = gc->last_time_to_safepoint;
+        }
+    }
+    trace_end(TRACE_SCAN_THREADS, trace_start);
+}
+
+static void start_world()
+{
+    atomic_store(&gc->safepoint_requested, 0);
+    release_claimed();
+    atomic_store(&gc->world_stopped, 0);
+    atomic_fetch_add(&gc->world_epoch, 1);
+    gc->cycle.pause_ns += now_ns() - gc->stopped_ns;
+}
+
+// Starts recording the heap pages written until the next collection, which
+// is what a minor collection rescans. Requires the world to be stopped.
+static void start_tracking()
+{
+    gc->tracking = gc->generational;
+    if (!gc->tracking)
+    {
+        return;
+    }
+
+    if (gc->soft_dirty)
+    {
+        soft_dirty_clear();
+    }
+    else
+    {
+        barrier_arm(&gc->heap);
+    }
+}
+
+// Moves the pages written since start_tracking() into the blocks' dirty
+// maps. They are only complete if the world is stopped.
+static void finish_tracking()
+{
+    if (!gc->tracking)
+    {
+        return;
+    }
+    gc->tracking = 0;
+
+    if (gc->soft_dirty)
+    {
+        soft_dirty_collect(&gc->heap);
+    }
+    else
+    {
+        barrier_disarm(&gc->heap);
+    }
+}
+
+// The heap lock is taken before the world is stopped, so no stopped thread
+// can be holding it. A minor collection keeps the marks of the previous
+// cycle: marked objects are old and only reached through the roots or
+// through pages written since then.
+static void collect_stop_the_world(int minor)
+{
+    gc->cycle_start_ns = now_ns();
+    struct PhaseClock clock;
+    phase_start(&clock, gc->cycle_start_ns);
+    roots_refresh(&gc->roots);
+    pthread_mutex_lock(&gc->heap.lock);
+    gc->donate_roots = gc->mark_pool.worker_cnt > 1;
+    // the rest of the previous sweep still needs the old marks
+    finish_sweep();
+
+    if (!minor)
+    {
+        heap_clear_marks(&gc->heap);
+    }
+    gc->cycle.sweep_ns += phase_lap(&clock, GC_COUNT_SWEEP);
+    scan_thread_stacks(1);
+    mark_sections();
+    gc->cycle.roots_ns += phase_lap(&clock, GC_COUNT_ROOTS);
+    finish_tracking();
+    if (minor)
+    {
+        mark_dirty_pages();
+    }
+    trace();
+    recover_overflow();
+    cache_mark_cells(&gc->heap);
+    gc->cycle.mark_ns += phase_lap(&clock, GC_COUNT_MARK);
+    start_tracking();
+
+    begin_sweep();
+    start_world();
+    pthread_mutex_unlock(&gc->heap.lock);
+}
+
+// Greys the roots without stopping the threads and arms the write barrier,
+// after which the heap can be traced while the mutators run.
+static void begin_concurrent_mark()
+{
+    gc->cycle_start_ns = now_ns();
+    struct PhaseClock clock;
+    phase_start(&clock, gc->cycle_start_ns);
+    roots_refresh(&gc->roots);
+    gc->donate_roots = 1;
+
+    pthread_mutex_lock(&gc->heap.lock);
+    finish_tracking();
+    finish_sweep();
+    heap_clear_marks(&gc->heap);
+    gc->heap.allocate_black = 1;
+    barrier_arm(&gc->heap);
+    pthread_mutex_unlock(&gc->heap.lock);
+    gc->cycle.sweep_ns += phase_lap(&clock, GC_COUNT_SWEEP);
+
+    mark_sections();
+    scan_thread_stacks(0);
+    gc->cycle.roots_ns += phase_lap(&clock, GC_COUNT_ROOTS);
+}
+
+// Final pause of a concurrent cycle: only the roots and the pages written
+// since begin_concurrent_mark() are rescanned. Returns with the heap lock
+// held, the heap queued for sweeping and the world restarted.
+static void finish_concurrent_mark()
+{
+    roots_refresh(&gc->roots);
+    pthread_mutex_lock(&gc->heap.lock);
+    struct PhaseClock clock;
+    phase_start(&clock, now_ns());
+    scan_thread_stacks(1);
+    mark_sections();
+    gc->cycle.roots_ns += phase_lap(&clock, GC_COUNT_ROOTS);
+    mark_dirty_pages();
+    trace();
+    recover_overflow();
+    cache_mark_cells(&gc->heap);
+    gc->cycle.mark_ns += phase_lap(&clock, GC_COUNT_MARK);
+    barrier_disarm(&gc->heap);
+    start_tracking();
+    gc->heap.allocate_black = 0;
+    begin_sweep();
+    start_world();
+}
+
+static void collect_concurrent()
+{
+    begin_concurrent_mark();
+    struct PhaseClock clock;
+    phase_start(&clock, now_ns());
+    trace();
+    gc->cycle.mark_ns += phase_lap(&clock, GC_COUNT_MARK);
+    finish_concurrent_mark();
+    pthread_mutex_unlock(&gc->heap.lock);
+}
+
+// Adds the cycle that has just restarted the world to the statistics and
+// logs it, now that no thread is stopped inside stdio. Requires
+// collect_garbage_mutex.
+// Gives the mappings of dead large objects back before the cycle ends,
+// unmapping outside the heap lock.
+static void release_mapped()
+{
+    struct FreeBatch batch = {0};
+    int more;
+    do
+    {
+        pthread_mutex_lock(&gc->heap.lock);
+        more = heap_sweep_mapped(&gc->heap, &batch);
+        pthread_mutex_unlock(&gc->heap.lock);
+        heap_free_batch(&batch);
+    } while (more);
+}
+
+static void finish_cycle(int minor)
+{
+    release_mapped();
+    stats_record(&gc->stats, &gc->cycle, minor);
+    gc->stats.live_bytes = gc->live_bytes;
+    gc->stats.counters_available = gc->counters_available;
+    gc->stats.metadata_bytes = heap_metadata_overhead(&gc->heap);
+    memset(&gc->cycle, 0, sizeof(gc->cycle));
+    if (gc->log != NULL)
+    {
+        stats_log(&gc->stats, gc->log);
+    }
+    alloc_trace_sweep(&gc->alloc_trace, &gc->heap);
+}
+
+// Advances the incremental cycle by about budget_ns of work. Marking runs
+// like a concurrent cycle traced in slices by the calling thread; the
+// sweep then works through the sweep queues a few blocks per slice, ahead
+// of the allocations that sweep lazily.
+static void incremental_step(unsigned long budget_ns)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (gc->phase == GC_PHASE_IDLE)
+    {
+        begin_concurrent_mark();
+        marker_init(&gc->incremental, &gc->heap, gc->mark_stack_limit, gc->unaligned_scan);
+        mark_pool_take(&gc->mark_pool, &gc->incremental);
+        gc->phase = GC_PHASE_MARK;
+        if (out_of_time(&start, budget_ns))
+        {
+            return;
+        }
+    }
+
+    if (gc->phase == GC_PHASE_MARK)
+    {
+        struct PhaseClock clock;
+        phase_start(&clock, now_ns());
+        while (marker_step(&gc->incremental, GC_STEP_WORK))
+        {
+            if (out_of_time(&start, budget_ns))
+            {
+                gc->cycle.mark_ns += phase_lap(&clock, GC_COUNT_MARK);
+                return;
+            }
+        }
+        gc->cycle.mark_ns += phase_lap(&clock, GC_COUNT_MARK);
+        if (gc->incremental.overflowed)
+        {
+            atomic_store(&gc->mark_overflowed, 1);
+        }
+        count_scanned(gc->incremental.scanned);
+        marker_destruct(&gc->incremental);
+
+        finish_concurrent_mark();
+        pthread_mutex_unlock(&gc->heap.lock);
+        finish_cycle(0);
+        gc->phase = GC_PHASE_SWEEP;
+        if (out_of_time(&start, budget_ns))
+        {
+            return;
+        }
+    }
+
+    for (;;)
+    {
+        unsigned long trace_start = trace_begin(TRACE_SWEEP);
+        pthread_mutex_lock(&gc->heap.lock);
+        int more = heap_sweep_step(&gc->heap, GC_SWEEP_STEP, NULL);
+        pthread_mutex_unlock(&gc->heap.lock);
+        trace_end(TRACE_SWEEP, trace_start);
+
+        if (!more)
+        {
+            gc->phase = GC_PHASE_IDLE;
+            return;
+        }
+        if (out_of_time(&start, budget_ns))
+        {
+            return;
+        }
+    }
+}
+
+enum GcPhase gc_collect_step(unsigned long budget_ns)
+{
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    unsigned long start = trace_begin(TRACE_STEP);
+    incremental_step(budget_ns);
+    trace_end(TRACE_STEP, start);
+    enum GcPhase phase = gc->phase;
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
+    return phase;
+}
+
+static void collect(int minor)
+{
+    unsigned long start = trace_begin(TRACE_COLLECT);
+    if (gc->phase != GC_PHASE_IDLE)
+    {
+        incremental_step(ULONG_MAX);
+    }
+
+    if (minor && gc->tracking)
+    {
+        gc->minor_cnt++;
+        collect_stop_the_world(1);
+        finish_cycle(1);
+    }
+    else
+    {
+        gc->minor_cnt = 0;
+        if (gc->concurrent)
+        {
+            collect_concurrent();
+        }
+        else
+        {
+            collect_stop_the_world(0);
+        }
+        finish_cycle(0);
+    }
+    trace_end(TRACE_COLLECT, start);
+}
+
+static void collect_default()
+{
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    collect(gc->generational && gc->minor_cnt < gc->major_interval);
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
+}
+
+void collect_garbage()
+{
+    alloc_trace_collect(&gc->alloc_trace, GC_TRACE_COLLECT_DEFAULT);
+    collect_default();
+}
 
+void collect_garbage_minor()
+{
+    alloc_trace_collect(&gc->alloc_trace, GC_TRACE_COLLECT_MINOR);
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    collect(1);
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
+}
+
+void collect_garbage_major()
+{
+    alloc_trace_collect(&gc->alloc_trace, GC_TRACE_COLLECT_MAJOR);
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    collect(0);
     pthread_mutex_unlock(&gc->collect_garbage_mutex);
 }
 
@@ -436,20 +1202,76 @@ void gc_signal_handler(int signum)
 {
     if (signum == SIGUSR1)
     {
+        // Read before scanning: once the stack is scanned the collector may
+        // already be stopping the world again for the next phase.
+        int stop = atomic_load(&gc->world_stopped);
+        int epoch = atomic_load(&gc->world_epoch);
+        if (stop)
+        {
+            record_arrival();
+        }
         mark_stack();
+        if (stop)
+        {
+            unsigned long start = trace_begin(TRACE_STOPPED);
+            while (atomic_load(&gc->world_epoch) == epoch)
+            {
+                sched_yield();
+            }
+            trace_end(TRACE_STOPPED, start);
+        }
     }
 }
 
-void gc_register_thread()
+// set_perf_counters() and a thread registering itself may both get to a
+// new thread; whichever claims perf_open opens or closes its counters.
+static void open_counters(struct ThreadState *state)
 {
-    atomic_fetch_add(&gc->threads_registring, 1);
+    int closed = 0;
+    if (atomic_compare_exchange_strong(&state->perf_open, &closed, -1))
+    {
+        __atomic_fetch_or(&gc->counters_available, perf_counters_open(&state->perf, state->tid), __ATOMIC_RELAXED);
+        atomic_store(&state->perf_open, 1);
+    }
+}
 
+static void close_counters(struct ThreadState *state)
+{
+    int open = 1;
+    if (atomic_compare_exchange_strong(&state->perf_open, &open, -1))
+    {
+        perf_counters_close(&state->perf);
+        atomic_store(&state->perf_open, 0);
+    }
+}
+
+void gc_register_thread()
+{
     pthread_t self = pthread_self();
     if (hashmap_contains(gc->threads, &self))
     {
         return;
     }
-    hashmap_insert(gc->threads, &self, 0);
+    atomic_fetch_add(&gc->threads_registring, 1);
+
+    struct ThreadState *state = safe_malloc(sizeof(struct ThreadState));
+    state->thread = self;
+    state->mode = GC_THREAD_RUNNING;
+    state->stack_base = get_stack_base();
+    state->stack_top = NULL;
+    memset(state->regs, 0, sizeof(state->regs));
+    state->claimed_next = NULL;
+    watermark_init(&state->watermark);
+    state->tid = perf_thread_id();
+    state->perf_open = 0;
+    perf_counters_init(&state->perf);
+    hashmap_insert(gc->threads, &self, &state);
+    thread_state = state;
+    thread_state_generation = gc_generation;
+    if (gc->perf_counters)
+    {
+        open_counters(state);
+    }
 
     struct sigaction sa;
     sa.sa_handler = &gc_signal_handler;
@@ -466,11 +1288,68 @@ void gc_register_thread()
 void gc_unregister_thread()
 {
     pthread_t self = pthread_self();
-    if (!hashmap_contains(gc->threads, &self))
+    struct Iterator it = hashmap_find(gc->threads, &self);
+    if (it.key == NULL)
     {
+        allow_writing(it);
         return;
     }
+    struct ThreadState *state = iterator_state(it);
+    allow_writing(it);
+
     hashmap_erase(gc->threads, &self);
+    thread_state = NULL;
+    trace_thread_exit();
+    watermark_destruct(&state->watermark);
+    close_counters(state);
+    free(state);
+}
+
+// Nothing on the heap may be touched between the two calls, as the stack
+// below this frame is not scanned. Blocking regions do not nest.
+void gc_enter_blocking()
+{
+    struct ThreadState *state = current_thread_state();
+    if (state == NULL)
+    {
+        return;
+    }
+    setjmp(state->regs);
+    state->stack_top = get_stack_top();
+    atomic_store(&state->mode, GC_THREAD_BLOCKING);
+}
+
+void gc_leave_blocking()
+{
+    struct ThreadState *state = current_thread_state();
+    if (state == NULL)
+    {
+        return;
+    }
+    int blocking = GC_THREAD_BLOCKING;
+    while (!atomic_compare_exchange_weak(&state->mode, &blocking, GC_THREAD_RUNNING))
+    {
+        // claimed by the collector until the world restarts
+        blocking = GC_THREAD_BLOCKING;
+        sched_yield();
+    }
+}
+
+void gc_safepoint()
+{
+    if (atomic_load_explicit(&gc->safepoint_requested, memory_order_relaxed))
+    {
+        record_arrival();
+        gc_enter_blocking();
+        // Parked until start_world(). Leaving at once would race with the
+        // collector's claim, which then signals a thread that may have
+        // SIGUSR1 blocked.
+        while (atomic_load(&gc->safepoint_requested))
+        {
+            sched_yield();
+        }
+        gc_leave_blocking();
+    }
 }
 
 void gc_pause()
@@ -485,10 +1364,211 @@ void gc_resume()
 
 int get_alive_allocations()
 {
-    return gc->allocations->size;
+    pthread_mutex_lock(&gc->heap.lock);
+    heap_sweep_step(&gc->heap, SIZE_MAX, NULL);
+    int cnt = gc->heap.object_cnt - cache_cell_cnt(&gc->heap);
+    pthread_mutex_unlock(&gc->heap.lock);
+    return cnt;
+}
+
+size_t get_metadata_overhead()
+{
+    return heap_metadata_overhead(&gc->heap);
+}
+
+unsigned long get_time_to_safepoint()
+{
+    return gc->last_time_to_safepoint;
+}
+
+unsigned long get_max_time_to_safepoint()
+{
+    return gc->max_time_to_safepoint;
+}
+
+size_t get_stack_bytes_reused()
+{
+    return atomic_load(&gc->stack_bytes_reused);
+}
+
+void gc_get_stats(struct GcStats *stats)
+{
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    *stats = gc->stats;
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
+    stats->metadata_bytes = heap_metadata_overhead(&gc->heap);
+}
+
+void set_gc_log(FILE *stream)
+{
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    gc->log = stream;
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
+}
+
+void set_allocation_trace(FILE *stream)
+{
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    alloc_trace_start(&gc->alloc_trace, stream);
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
+}
+
+unsigned set_perf_counters(int enabled)
+{
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    gc->perf_counters = enabled;
+    if (!enabled)
+    {
+        gc->counters_available = 0;
+    }
+    struct Iterator it = hashmap_begin(gc->threads);
+    while (hashmap_not_end(it))
+    {
+        if (enabled)
+        {
+            open_counters(iterator_state(it));
+        }
+        else
+        {
+            close_counters(iterator_state(it));
+        }
+        it = hashmap_next(it);
+    }
+    allow_writing(it);
+    unsigned available = gc->counters_available;
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
+    return available;
+}
+
+void set_tracing(int enabled)
+{
+    trace_set_enabled(enabled);
+}
+
+void gc_trace_dump(FILE *stream)
+{
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    trace_dump(stream);
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
 }
 
 void set_allocation_threshold(unsigned threshold)
 {
     gc->allocation_threshold = threshold;
 }
+
+void set_heap_growth(unsigned percent)
+{
+    gc->heap_growth = percent;
+}
+
+void set_heap_limits(size_t min_bytes, size_t max_bytes)
+{
+    gc->min_heap = min_bytes;
+    gc->max_heap = max_bytes > min_bytes ? max_bytes : min_bytes;
+    pthread_mutex_lock(&gc->heap.lock);
+    gc->trigger_bytes = clamp_allowance(gc->live_bytes, gc->trigger_bytes);
+    pthread_mutex_unlock(&gc->heap.lock);
+}
+
+size_t get_live_bytes()
+{
+    return gc->live_bytes;
+}
+
+size_t get_trigger_bytes()
+{
+    return gc->trigger_bytes;
+}
+
+void set_unaligned_scan(int enabled)
+{
+    gc->unaligned_scan = enabled;
+}
+
+void set_mark_stack_limit(size_t entries)
+{
+    gc->mark_stack_limit = entries > 0 ? entries : 1;
+}
+
+void set_concurrent_marking(int enabled)
+{
+    gc->concurrent = enabled;
+}
+
+void set_generational(int enabled)
+{
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    if (enabled && !gc->generational)
+    {
+        gc->soft_dirty = soft_dirty_init();
+    }
+    gc->generational = enabled;
+    if (!enabled && gc->phase != GC_PHASE_MARK)
+    {
+        // without soft-dirty bits the barrier would stay armed until the
+        // next collection
+        pthread_mutex_lock(&gc->heap.lock);
+        finish_tracking();
+        pthread_mutex_unlock(&gc->heap.lock);
+    }
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
+}
+
+void set_major_collection_interval(unsigned minor_collections)
+{
+    gc->major_interval = minor_collections;
+}
+
+void set_incremental(unsigned long budget_ns)
+{
+    gc->incremental_budget = budget_ns;
+}
+
+void set_background_sweep(int enabled)
+{
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    if (enabled && !gc->background_sweep)
+    {
+        gc->background_sweep = sweeper_init(&gc->sweeper, &gc->heap);
+    }
+    else if (!enabled && gc->background_sweep)
+    {
+        sweeper_destruct(&gc->sweeper);
+        gc->background_sweep = 0;
+    }
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
+}
+
+void set_safepoint_polling(unsigned long wait_ns)
+{
+    gc->safepoint_wait_ns = wait_ns;
+}
+
+void set_stack_watermark(int enabled)
+{
+    gc->stack_watermark = enabled;
+}
+
+void set_large_object_threshold(size_t bytes)
+{
+    pthread_mutex_lock(&gc->heap.lock);
+    gc->heap.map_threshold = bytes;
+    pthread_mutex_unlock(&gc->heap.lock);
+}
+
+void set_root_discovery(int enabled)
+{
+    sigset_t old;
+    block_scan_signal(&old);
+    roots_set_discovery(&gc->roots, enabled);
+    restore_scan_signal(&old);
+}
+
+void set_marker_threads(unsigned count)
+{
+    pthread_mutex_lock(&gc->collect_garbage_mutex);
+    mark_pool_destruct(&gc->mark_pool);
+    mark_pool_init(&gc->mark_pool, &gc->heap, count);
+    pthread_mutex_unlock(&gc->collect_garbage_mutex);
+}
@@ -0,0 +1,817 @@
+#include "heap.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "safe_functions.h"
+
+static const size_t class_sizes[GC_SMALL_CLASS_CNT] = {
+    16, 32, 48, 64, 80, 96, 112, 128, 160, 192,
+    224, 256, 320, 384, 448, 512, 640, 768, 1024};
+
+static unsigned char size_to_class[GC_MAX_SMALL_SIZE / GC_GRANULE + 1];
+
+void heap_init(struct Heap *heap)
+{
+    unsigned c = 0;
+    for (unsigned i = 0; i <= GC_MAX_SMALL_SIZE / GC_GRANULE; i++)
+    {
+        while (class_sizes[c] < i * GC_GRANULE)
+        {
+            c++;
+        }
+        size_to_class[i] = c;
+    }
+
+    for (unsigned i = 0; i < GC_SIZE_CLASS_CNT; i++)
+    {
+        heap->classes[i].object_size = class_sizes[i % GC_SMALL_CLASS_CNT];
+        heap->classes[i].object_cnt = GC_BLOCK_SIZE / heap->classes[i].object_size;
+        heap->classes[i].partial = NULL;
+        heap->classes[i].unswept = NULL;
+    }
+
+    heap->blocks = NULL;
+    heap->large = NULL;
+    pagemap_init(&heap->pagemap);
+    heap->low = UINTPTR_MAX;
+    heap->high = 0;
+
+    heap->free_blocks = NULL;
+    heap->chunk_cursor = NULL;
+    heap->chunk_end = NULL;
+    heap->chunks = NULL;
+    heap->chunk_cnt = 0;
+    heap->chunk_capacity = 0;
+
+    heap->mark_segments = NULL;
+    heap->mark_segment_cnt = 0;
+    heap->free_marks = NULL;
+    heap->free_mark_cnt = 0;
+
+    heap->object_cnt = 0;
+    heap->object_bytes = 0;
+    heap->metadata_bytes = 0;
+    heap->map_threshold = GC_MAP_THRESHOLD;
+    heap->mapped_bytes = 0;
+    heap->page_size = sysconf(_SC_PAGESIZE);
+    if (heap->page_size < GC_BLOCK_SIZE)
+    {
+        heap->page_size = GC_BLOCK_SIZE;
+    }
+
+    heap->allocate_black = 0;
+    heap->track_dirty = 0;
+    heap->unswept_large = NULL;
+
+    pthread_mutex_init(&heap->lock, NULL);
+}
+
+static size_t large_span(const struct Heap *heap, size_t size)
+{
+    return (size + heap->page_size - 1) & ~(heap->page_size - 1);
+}
+
+size_t block_span(const struct Block *block)
+{
+    if (block->size_class == GC_LARGE_CLASS)
+    {
+        return (block->object_size + GC_BLOCK_SIZE - 1) & ~(GC_BLOCK_SIZE - 1);
+    }
+    return GC_BLOCK_SIZE;
+}
+
+static size_t descriptors_size(enum ObjectKind kind, unsigned object_cnt)
+{
+    return kind == GC_KIND_TYPED ? object_cnt * sizeof(struct GcDescriptor *) : 0;
+}
+
+static size_t block_metadata(const struct Block *block)
+{
+    return sizeof(struct Block) + descriptors_size(block->kind, block->object_cnt) + block->object_cnt + block_span(block) / GC_BLOCK_SIZE;
+}
+
+static void unlink_block(struct Heap *heap, struct Block *block)
+{
+    if (block->all_prev != NULL)
+    {
+        block->all_prev->all_next = block->all_next;
+    }
+    else
+    {
+        heap->blocks = block->all_next;
+    }
+    if (block->all_next != NULL)
+    {
+        block->all_next->all_prev = block->all_prev;
+    }
+
+    if (block->size_class != GC_LARGE_CLASS)
+    {
+        return;
+    }
+    if (block->large_prev != NULL)
+    {
+        block->large_prev->large_next = block->large_next;
+    }
+    else
+    {
+        heap->large = block->large_next;
+    }
+    if (block->large_next != NULL)
+    {
+        block->large_next->large_prev = block->large_prev;
+    }
+}
+
+static void defer_free(struct FreeBatch *batch, void *ptr)
+{
+    if (batch == NULL)
+    {
+        free(ptr);
+        return;
+    }
+    batch->ptrs[batch->cnt++] = ptr;
+}
+
+static void defer_unmap(struct FreeBatch *batch, void *start, size_t size)
+{
+    if (batch == NULL)
+    {
+        munmap(start, size);
+        return;
+    }
+    batch->maps[batch->map_cnt].start = start;
+    batch->maps[batch->map_cnt].size = size;
+    batch->map_cnt++;
+}
+
+// With a batch the calls to free() are left to the caller, who can make
+// them after dropping the heap lock.
+static void release_block(struct Heap *heap, struct Block *block, struct FreeBatch *batch)
+{
+    unlink_block(heap, block);
+    pagemap_set(&heap->pagemap, block->start, block_span(block), NULL);
+
+    if (block->mapped)
+    {
+        heap->mapped_bytes -= large_span(heap, block->object_size);
+        defer_unmap(batch, block->start, large_span(heap, block->object_size));
+    }
+    else if (block->size_class == GC_LARGE_CLASS)
+    {
+        // free() may write into the object, which the write barrier no
+        // longer recognises once its page map entry is gone
+        if (heap->track_dirty)
+        {
+            mprotect(block->start, block_span(block), PROT_READ | PROT_WRITE);
+        }
+        defer_free(batch, block->start);
+    }
+    else
+    {
+        *(void **)block->start = heap->free_blocks;
+        heap->free_blocks = block->start;
+    }
+
+    heap->free_marks[heap->free_mark_cnt++] = block->marks;
+    heap->metadata_bytes -= block_metadata(block);
+    defer_free(batch, block);
+}
+
+void heap_destruct(struct Heap *heap)
+{
+    struct Block *block = heap->blocks;
+    while (block != NULL)
+    {
+        struct Block *next = block->all_next;
+        if (block->mapped)
+        {
+            munmap(block->start, large_span(heap, block->object_size));
+        }
+        else if (block->size_class == GC_LARGE_CLASS)
+        {
+            free(block->start);
+        }
+        free(block);
+        block = next;
+    }
+    heap->blocks = NULL;
+    heap->large = NULL;
+
+    for (unsigned i = 0; i < heap->chunk_cnt; i++)
+    {
+        munmap(heap->chunks[i], GC_CHUNK_BLOCKS * GC_BLOCK_SIZE);
+    }
+    free(heap->chunks);
+
+    for (unsigned i = 0; i < heap->mark_segment_cnt; i++)
+    {
+        munmap(heap->mark_segments[i], GC_BLOCK_SIZE);
+    }
+    free(heap->mark_segments);
+    free(heap->free_marks);
+
+    pagemap_destruct(&heap->pagemap);
+
+    pthread_mutex_destroy(&heap->lock);
+}
+
+static void *take_block_memory(struct Heap *heap)
+{
+    if (heap->free_blocks != NULL)
+    {
+        void *mem = heap->free_blocks;
+        heap->free_blocks = *(void **)mem;
+        return mem;
+    }
+
+    if (heap->chunk_cursor == heap->chunk_end)
+    {
+        void *chunk = mmap(NULL, GC_CHUNK_BLOCKS * GC_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (chunk == MAP_FAILED)
+        {
+            return NULL;
+        }
+        if (heap->chunk_cnt == heap->chunk_capacity)
+        {
+            heap->chunk_capacity = heap->chunk_capacity ? 2 * heap->chunk_capacity : 8;
+            heap->chunks = safe_realloc(heap->chunks, heap->chunk_capacity * sizeof(void *));
+        }
+        heap->chunks[heap->chunk_cnt++] = chunk;
+        heap->chunk_cursor = chunk;
+        heap->chunk_end = (char *)chunk + GC_CHUNK_BLOCKS * GC_BLOCK_SIZE;
+    }
+
+    void *mem = heap->chunk_cursor;
+    heap->chunk_cursor = (char *)heap->chunk_cursor + GC_BLOCK_SIZE;
+    return mem;
+}
+
+// Mark bitmaps live in page-sized mmap'd segments of GC_MARK_WORDS-word
+// slots, away from both the objects and their descriptors, so that marking
+// dirties only these pages and clearing all marks is a memset per segment.
+static uint64_t *take_marks(struct Heap *heap)
+{
+    if (heap->free_mark_cnt == 0)
+    {
+        uint64_t *segment = mmap(NULL, GC_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (segment == MAP_FAILED)
+        {
+            return NULL;
+        }
+        heap->mark_segments = safe_realloc(heap->mark_segments, (heap->mark_segment_cnt + 1) * sizeof(uint64_t *));
+        heap->mark_segments[heap->mark_segment_cnt++] = segment;
+        heap->free_marks = safe_realloc(heap->free_marks, heap->mark_segment_cnt * GC_MARK_SEGMENT_SLOTS * sizeof(uint64_t *));
+        for (size_t i = GC_MARK_SEGMENT_SLOTS; i-- > 0;)
+        {
+            heap->free_marks[heap->free_mark_cnt++] = segment + i * GC_MARK_WORDS;
+        }
+        heap->metadata_bytes += GC_BLOCK_SIZE;
+    }
+
+    uint64_t *marks = heap->free_marks[--heap->free_mark_cnt];
+    memset(marks, 0, GC_MARK_WORDS * sizeof(uint64_t));
+    return marks;
+}
+
+static struct Block *new_block(struct Heap *heap, void *start, unsigned size_class, enum ObjectKind kind, size_t object_size, unsigned object_cnt)
+{
+    size_t pages = size_class == GC_LARGE_CLASS ? (object_size + GC_BLOCK_SIZE - 1) / GC_BLOCK_SIZE : 1;
+    uint64_t *marks = take_marks(heap);
+    if (marks == NULL)
+    {
+        return NULL;
+    }
+    size_t descriptors = descriptors_size(kind, object_cnt);
+    struct Block *block = safe_malloc(sizeof(struct Block) + descriptors + object_cnt + pages);
+    block->next = NULL;
+    block->all_next = heap->blocks;
+    block->all_prev = NULL;
+    block->large_next = NULL;
+    block->large_prev = NULL;
+    block->start = start;
+    block->object_size = object_size;
+    block->size_class = size_class;
+    block->kind = kind;
+    block->object_cnt = object_cnt;
+    block->free_cnt = object_cnt;
+    block->bump = 0;
+    block->sweep_pending = 0;
+    block->mapped = 0;
+    block->free_list = NULL;
+    block->descriptors = NULL;
+    if (descriptors != 0)
+    {
+        block->descriptors = (const struct GcDescriptor **)(block + 1);
+        memset(block->descriptors, 0, descriptors);
+    }
+    block->flags = (unsigned char *)(block + 1) + descriptors;
+    memset(block->flags, 0, object_cnt);
+    block->dirty = block->flags + object_cnt;
+    memset(block->dirty, heap->track_dirty, pages);
+    block->marks = marks;
+
+    if (!pagemap_set(&heap->pagemap, start, block_span(block), block))
+    {
+        pagemap_set(&heap->pagemap, start, block_span(block), NULL);
+        heap->free_marks[heap->free_mark_cnt++] = marks;
+        free(block);
+        return NULL;
+    }
+    if ((uintptr_t)start < heap->low)
+    {
+        heap->low = (uintptr_t)start;
+    }
+    if ((uintptr_t)start + block_span(block) > heap->high)
+    {
+        heap->high = (uintptr_t)start + block_span(block);
+    }
+    if (heap->blocks != NULL)
+    {
+        heap->blocks->all_prev = block;
+    }
+    heap->blocks = block;
+    if (size_class == GC_LARGE_CLASS)
+    {
+        block->large_next = heap->large;
+        if (heap->large != NULL)
+        {
+            heap->large->large_prev = block;
+        }
+        heap->large = block;
+    }
+    heap->metadata_bytes += block_metadata(block);
+    return block;
+}
+
+static void free_cell(struct Heap *heap, struct Block *block, unsigned index)
+{
+    block_clear_descriptor(block, index);
+    void *ptr = block_object(block, index);
+    *(void **)ptr = block->free_list;
+    block->free_list = ptr;
+    block->free_cnt++;
+    heap->object_cnt--;
+    heap->object_bytes -= block->object_size;
+}
+
+static void free_object(struct Heap *heap, struct Block *block, unsigned index)
+{
+    block->flags[index] = 0;
+    free_cell(heap, block, index);
+}
+
+static void sweep_block(struct Heap *heap, struct Block *block, struct FreeBatch *batch)
+{
+    block->sweep_pending = 0;
+    for (unsigned i = 0; i < block->bump; i++)
+    {
+        // thread caches free without the heap lock, so claim the object
+        unsigned char flags = __atomic_load_n(&block->flags[i], __ATOMIC_RELAXED);
+        if ((flags & GC_FLAG_ALLOCATED) && (flags & GC_FLAG_ACTIVE) && !block_marked(block, i)
+            && __atomic_compare_exchange_n(&block->flags[i], &flags, 0, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            free_cell(heap, block, i);
+        }
+    }
+
+    if (block->free_cnt == block->object_cnt)
+    {
+        release_block(heap, block, batch);
+    }
+    else if (block->free_cnt > 0)
+    {
+        struct SizeClass *sc = &heap->classes[block->size_class];
+        block->next = sc->partial;
+        sc->partial = block;
+    }
+}
+
+static void sweep_next(struct Heap *heap, struct Block **queue, struct FreeBatch *batch)
+{
+    struct Block *block = *queue;
+    *queue = block->next;
+    block->next = NULL;
+    sweep_block(heap, block, batch);
+}
+
+static void *alloc_large(struct Heap *heap, size_t size, enum ObjectKind kind)
+{
+    // give the memory of dead large objects back before asking for more
+    size_t live = heap->object_cnt;
+    while (heap->unswept_large != NULL && heap->object_cnt == live)
+    {
+        sweep_next(heap, &heap->unswept_large, NULL);
+    }
+
+    // objects from the threshold on get a mapping of their own, which goes
+    // back to the system as soon as they die
+    size_t span = large_span(heap, size);
+    int mapped = size >= heap->map_threshold;
+    void *mem = NULL;
+    if (mapped)
+    {
+        mem = mmap(NULL, span, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            return NULL;
+        }
+    }
+    else if (posix_memalign(&mem, heap->page_size, span) != 0)
+    {
+        return NULL;
+    }
+
+    struct Block *block = new_block(heap, mem, GC_LARGE_CLASS, kind, size, 1);
+    if (block == NULL)
+    {
+        if (mapped)
+        {
+            munmap(mem, span);
+        }
+        else
+        {
+            free(mem);
+        }
+        return NULL;
+    }
+    if (mapped)
+    {
+        block->mapped = 1;
+        heap->mapped_bytes += span;
+    }
+    block->free_cnt = 0;
+    block->bump = 1;
+    block->flags[0] = GC_FLAG_ALLOCATED | GC_FLAG_ACTIVE;
+    if (heap->allocate_black)
+    {
+        block_mark(block, 0);
+    }
+    heap->object_cnt++;
+    heap->object_bytes += block->object_size;
+    return mem;
+}
+
+unsigned heap_size_class(size_t size, enum ObjectKind kind)
+{
+    return size_to_class[(size + GC_GRANULE - 1) / GC_GRANULE] + kind * GC_SMALL_CLASS_CNT;
+}
+
+// Takes a free cell of the class off a swept block, leaving its flags to
+// the caller. Never hands out cells of blocks queued for sweeping.
+static void *take_cell(struct Heap *heap, unsigned size_class)
+{
+    struct SizeClass *sc = &heap->classes[size_class];
+
+    while (sc->partial == NULL && sc->unswept != NULL)
+    {
+        sweep_next(heap, &sc->unswept, NULL);
+    }
+
+    struct Block *block = sc->partial;
+    if (block == NULL)
+    {
+        void *mem = take_block_memory(heap);
+        if (mem == NULL)
+        {
+            return NULL;
+        }
+        block = new_block(heap, mem, size_class, size_class / GC_SMALL_CLASS_CNT, sc->object_size, sc->object_cnt);
+        if (block == NULL)
+        {
+            *(void **)mem = heap->free_blocks;
+            heap->free_blocks = mem;
+            return NULL;
+        }
+        sc->partial = block;
+    }
+
+    void *ptr;
+    if (block->free_list != NULL)
+    {
+        ptr = block->free_list;
+        block->free_list = *(void **)ptr;
+    }
+    else
+    {
+        ptr = block_object(block, block->bump++);
+    }
+
+    if (--block->free_cnt == 0)
+    {
+        sc->partial = block->next;
+        block->next = NULL;
+    }
+    return ptr;
+}
+
+void *heap_alloc(struct Heap *heap, size_t size, enum ObjectKind kind)
+{
+    if (size == 0)
+    {
+        size = 1;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+
+    if (size > GC_MAX_SMALL_SIZE)
+    {
+        void *ptr = alloc_large(heap, size, kind);
+        pthread_mutex_unlock(&heap->lock);
+        return ptr;
+    }
+
+    unsigned size_class = heap_size_class(size, kind);
+    void *ptr = take_cell(heap, size_class);
+    if (ptr == NULL)
+    {
+        pthread_mutex_unlock(&heap->lock);
+        return NULL;
+    }
+
+    struct Block *block = pagemap_get(&heap->pagemap, ptr);
+    unsigned index = ((char *)ptr - (char *)block->start) / block->object_size;
+    block->flags[index] = GC_FLAG_ALLOCATED | GC_FLAG_ACTIVE;
+    if (heap->allocate_black)
+    {
+        block_mark(block, index);
+    }
+    else
+    {
+        block_unmark(block, index);
+    }
+    heap->object_cnt++;
+    heap->object_bytes += block->object_size;
+
+    pthread_mutex_unlock(&heap->lock);
+    return ptr;
+}
+
+unsigned heap_take_cells(struct Heap *heap, unsigned size_class, void **cells, unsigned n)
+{
+    unsigned got = 0;
+    while (got < n)
+    {
+        void *ptr = take_cell(heap, size_class);
+        if (ptr == NULL)
+        {
+            break;
+        }
+        struct Block *block = pagemap_get(&heap->pagemap, ptr);
+        block_unmark(block, ((char *)ptr - (char *)block->start) / block->object_size);
+        cells[got++] = ptr;
+    }
+    heap->object_cnt += got;
+    heap->object_bytes += got * heap->classes[size_class].object_size;
+    return got;
+}
+
+void heap_return(struct Heap *heap, void *const *cells, unsigned n)
+{
+    pthread_mutex_lock(&heap->lock);
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        struct Block *block = pagemap_get(&heap->pagemap, cells[i]);
+        *(void **)cells[i] = block->free_list;
+        block->free_list = cells[i];
+        heap->object_bytes -= block->object_size;
+        if (++block->free_cnt == 1 && !block->sweep_pending)
+        {
+            struct SizeClass *sc = &heap->classes[block->size_class];
+            block->next = sc->partial;
+            sc->partial = block;
+        }
+    }
+    heap->object_cnt -= n;
+
+    pthread_mutex_unlock(&heap->lock);
+}
+
+void heap_free(struct Heap *heap, struct Block *block, unsigned index)
+{
+    pthread_mutex_lock(&heap->lock);
+
+    if (block->size_class == GC_LARGE_CLASS)
+    {
+        if (heap->allocate_black || block->sweep_pending)
+        {
+            // a concurrent marker may still be reading the object, or the
+            // block waits in a sweep queue: leave it to the sweep
+            block_unmark(block, index);
+        }
+        else
+        {
+            heap->object_cnt--;
+            heap->object_bytes -= block->object_size;
+            release_block(heap, block, NULL);
+        }
+        pthread_mutex_unlock(&heap->lock);
+        return;
+    }
+
+    free_object(heap, block, index);
+    if (block->free_cnt == 1 && !block->sweep_pending)
+    {
+        struct SizeClass *sc = &heap->classes[block->size_class];
+        block->next = sc->partial;
+        sc->partial = block;
+    }
+
+    pthread_mutex_unlock(&heap->lock);
+}
+
+int heap_find_object(struct Heap *heap, const void *ptr, struct Block **block, unsigned *index)
+{
+    return heap_resolve(heap, ptr, block, index) && block_object(*block, *index) == ptr;
+}
+
+// Batched heap_resolve: the hits are compacted to the front of blocks and
+// indices and their count is returned.
+unsigned heap_resolve_many(struct Heap *heap, void *const *ptrs, unsigned n, struct Block **blocks, unsigned *indices)
+{
+    pagemap_get_many(&heap->pagemap, ptrs, n, blocks);
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        if (blocks[i] != NULL)
+        {
+            __builtin_prefetch(blocks[i]);
+        }
+    }
+
+    unsigned found = 0;
+    for (unsigned i = 0; i < n; i++)
+    {
+        struct Block *b = blocks[i];
+        if (b == NULL)
+        {
+            continue;
+        }
+        size_t offset = (const char *)ptrs[i] - (const char *)b->start;
+        unsigned index = b->object_cnt == 1 ? 0 : offset / b->object_size;
+        if (index >= b->object_cnt || offset - (size_t)index * b->object_size >= b->object_size)
+        {
+            continue;
+        }
+        __builtin_prefetch(&b->flags[index]);
+        blocks[found] = b;
+        indices[found] = index;
+        found++;
+    }
+
+    unsigned live = 0;
+    for (unsigned i = 0; i < found; i++)
+    {
+        if (blocks[i]->flags[indices[i]] & GC_FLAG_ALLOCATED)
+        {
+            blocks[live] = blocks[i];
+            indices[live] = indices[i];
+            live++;
+        }
+    }
+    return live;
+}
+
+void heap_clear_marks(struct Heap *heap)
+{
+    for (unsigned i = 0; i < heap->mark_segment_cnt; i++)
+    {
+        memset(heap->mark_segments[i], 0, GC_BLOCK_SIZE);
+    }
+}
+
+void heap_sweep(struct Heap *heap)
+{
+    heap_sweep_begin(heap);
+    heap_sweep_step(heap, SIZE_MAX, NULL);
+}
+
+// Queues every block for sweeping and returns at once; the sweep itself
+// happens lazily. An allocation that finds no partial block of its class
+// sweeps queued blocks of that class first, and heap_sweep_step works
+// through the queues on behalf of the collector. Queued blocks are kept off
+// the partial lists, so allocation only ever uses blocks already swept.
+void heap_sweep_begin(struct Heap *heap)
+{
+    for (unsigned i = 0; i < GC_SIZE_CLASS_CNT; i++)
+    {
+        heap->classes[i].partial = NULL;
+        heap->classes[i].unswept = NULL;
+    }
+    heap->unswept_large = NULL;
+
+    for (struct Block *block = heap->blocks; block != NULL; block = block->all_next)
+    {
+        struct Block **queue = block->size_class == GC_LARGE_CLASS ? &heap->unswept_large : &heap->classes[block->size_class].unswept;
+        block->sweep_pending = 1;
+        block->next = *queue;
+        *queue = block;
+    }
+}
+
+// Sweeps up to budget queued blocks, returns whether any are left. With a
+// batch at most GC_FREE_BATCH blocks are swept and the memory they release
+// is collected in it for heap_free_batch().
+int heap_sweep_step(struct Heap *heap, size_t budget, struct FreeBatch *batch)
+{
+    if (batch != NULL && budget > GC_FREE_BATCH)
+    {
+        budget = GC_FREE_BATCH;
+    }
+
+    size_t done = 0;
+    for (unsigned i = 0; i < GC_SIZE_CLASS_CNT && done < budget; i++)
+    {
+        while (heap->classes[i].unswept != NULL && done < budget)
+        {
+            sweep_next(heap, &heap->classes[i].unswept, batch);
+            done++;
+        }
+    }
+    while (heap->unswept_large != NULL && done < budget)
+    {
+        sweep_next(heap, &heap->unswept_large, batch);
+        done++;
+    }
+
+    if (heap->unswept_large != NULL)
+    {
+        return 1;
+    }
+    for (unsigned i = 0; i < GC_SIZE_CLASS_CNT; i++)
+    {
+        if (heap->classes[i].unswept != NULL)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Sweeps up to GC_FREE_BATCH queued large objects that have mappings of
+// their own, returns whether any are left. They are few and a dead one
+// holds its whole mapping, so the collector sweeps them right after the
+// cycle instead of leaving them to the lazy sweep.
+int heap_sweep_mapped(struct Heap *heap, struct FreeBatch *batch)
+{
+    unsigned done = 0;
+    struct Block **queue = &heap->unswept_large;
+    while (*queue != NULL)
+    {
+        if (!(*queue)->mapped)
+        {
+            queue = &(*queue)->next;
+        }
+        else if (done == GC_FREE_BATCH)
+        {
+            return 1;
+        }
+        else
+        {
+            sweep_next(heap, queue, batch);
+            done++;
+        }
+    }
+    return 0;
+}
+
+void heap_free_batch(struct FreeBatch *batch)
+{
+    for (unsigned i = 0; i < batch->cnt; i++)
+    {
+        free(batch->ptrs[i]);
+    }
+    batch->cnt = 0;
+    for (unsigned i = 0; i < batch->map_cnt; i++)
+    {
+        munmap(batch->maps[i].start, batch->maps[i].size);
+    }
+    batch->map_cnt = 0;
+}
+
+size_t heap_metadata_overhead(struct Heap *heap)
+{
+    return heap->metadata_bytes + pagemap_overhead(&heap->pagemap);
+}
+
+size_t heap_marked_bytes(struct Heap *heap, size_t *objects)
+{
+    size_t bytes = 0;
+    *objects = 0;
+    for (struct Block *block = heap->blocks; block != NULL; block = block->all_next)
+    {
+        size_t marked = 0;
+        for (unsigned i = 0; i < GC_MARK_WORDS; i++)
+        {
+            marked += __builtin_popcountll(block->marks[i]);
+        }
+        bytes += marked * block->object_size;
+        *objects += marked;
+    }
+    return bytes;
+}
@@ -0,0 +1,335 @@
+#include "mark.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+void marker_init(struct Marker *marker, struct Heap *heap, size_t limit, int unaligned)
+{
+    marker->heap = heap;
+    marker->range.low = heap->low;
+    marker->range.high = heap->high;
+    marker->range.unaligned = unaligned;
+    marker->candidates.cnt = 0;
+
+    marker->stack = NULL;
+    marker->size = 0;
+    marker->capacity = 0;
+    marker->limit = limit;
+    marker->overflowed = 0;
+    marker->scanned = 0;
+
+    marker->fifo_head = 0;
+    marker->fifo_cnt = 0;
+}
+
+void marker_destruct(struct Marker *marker)
+{
+    if (marker->stack != NULL)
+    {
+        munmap(marker->stack, marker->capacity * sizeof(struct MarkEntry));
+    }
+    marker->stack = NULL;
+    marker->capacity = 0;
+    marker->size = 0;
+}
+
+// Growth uses mmap rather than malloc: the marker also runs inside the
+// stack-scanning signal handler.
+static int grow(struct Marker *marker)
+{
+    size_t capacity = marker->capacity ? 2 * marker->capacity : GC_MARK_STACK_INITIAL;
+    if (capacity > marker->limit)
+    {
+        capacity = marker->limit;
+    }
+    if (capacity <= marker->capacity)
+    {
+        return 0;
+    }
+
+    struct MarkEntry *stack = mmap(NULL, capacity * sizeof(struct MarkEntry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (stack == MAP_FAILED)
+    {
+        return 0;
+    }
+    if (marker->stack != NULL)
+    {
+        memcpy(stack, marker->stack, marker->size * sizeof(struct MarkEntry));
+        munmap(marker->stack, marker->capacity * sizeof(struct MarkEntry));
+    }
+    marker->stack = stack;
+    marker->capacity = capacity;
+    return 1;
+}
+
+void marker_push_entry(struct Marker *marker, struct MarkEntry entry)
+{
+    if (marker->size == marker->capacity && !grow(marker))
+    {
+        marker->overflowed = 1;
+        return;
+    }
+    marker->stack[marker->size++] = entry;
+}
+
+static const struct GcDescriptor *object_descriptor(const struct Block *block, unsigned index)
+{
+    if (block->kind != GC_KIND_TYPED)
+    {
+        return NULL;
+    }
+    return __atomic_load_n(&block->descriptors[index], __ATOMIC_ACQUIRE);
+}
+
+static void mark_object(struct Marker *marker, struct Block *block, unsigned index)
+{
+    if (!(__atomic_load_n(&block->flags[index], __ATOMIC_RELAXED) & GC_FLAG_ACTIVE) || block_mark(block, index) || block->kind == GC_KIND_POINTER_FREE)
+    {
+        return;
+    }
+    struct MarkEntry entry;
+    entry.start = block_object(block, index);
+    entry.end = (char *)entry.start + block->object_size;
+    entry.descriptor = object_descriptor(block, index);
+    marker_push_entry(marker, entry);
+}
+
+static void flush_candidates(struct Marker *marker)
+{
+    struct Candidates *candidates = &marker->candidates;
+    void **ptrs = candidates->ptrs;
+    unsigned n = candidates->cnt;
+    candidates->cnt = 0;
+
+    for (unsigned i = 1; i < n; i++)
+    {
+        void *ptr = ptrs[i];
+        unsigned j = i;
+        while (j > 0 && ptrs[j - 1] > ptr)
+        {
+            ptrs[j] = ptrs[j - 1];
+            j--;
+        }
+        ptrs[j] = ptr;
+    }
+    unsigned unique = 0;
+    for (unsigned i = 0; i < n; i++)
+    {
+        if (unique == 0 || ptrs[unique - 1] != ptrs[i])
+        {
+            ptrs[unique++] = ptrs[i];
+        }
+    }
+
+    struct Block *blocks[GC_CANDIDATE_BATCH];
+    unsigned indices[GC_CANDIDATE_BATCH];
+    unsigned found = heap_resolve_many(marker->heap, ptrs, unique, blocks, indices);
+    for (unsigned i = 0; i < found; i++)
+    {
+        mark_object(marker, blocks[i], indices[i]);
+    }
+}
+
+static void add_candidate(void *ptr, void *ctx)
+{
+    struct Marker *marker = ctx;
+    struct Candidates *candidates = &marker->candidates;
+    candidates->ptrs[candidates->cnt++] = ptr;
+    if (candidates->cnt == GC_CANDIDATE_BATCH)
+    {
+        flush_candidates(marker);
+    }
+}
+
+static void scan(struct Marker *marker, const void *start, const void *end)
+{
+    marker->scanned += (const char *)end - (const char *)start;
+    scan_words(start, end, &marker->range, add_candidate, marker);
+    flush_candidates(marker);
+}
+
+static void scan_entry(struct Marker *marker, struct MarkEntry entry)
+{
+    if (entry.descriptor == NULL)
+    {
+        scan(marker, entry.start, entry.end);
+        return;
+    }
+    marker->scanned += (char *)entry.end - (char *)entry.start;
+    descriptor_scan(entry.descriptor, entry.start, entry.end, &marker->range, add_candidate, marker);
+    flush_candidates(marker);
+}
+
+// Scans [start, end) of a marked object, which for a typed object is
+// widened to whole elements.
+static void scan_object_part(struct Marker *marker, struct Block *block, unsigned index, char *start, char *end)
+{
+    struct MarkEntry entry;
+    entry.start = start;
+    entry.end = end;
+    entry.descriptor = object_descriptor(block, index);
+    if (entry.descriptor != NULL)
+    {
+        char *object = block_object(block, index);
+        size_t size = entry.descriptor->size;
+        entry.start = start - (size_t)(start - object) % size;
+        size_t tail = (size_t)(end - object) % size;
+        if (tail != 0)
+        {
+            char *object_end = object + block->object_size;
+            entry.end = end + (size - tail) < object_end ? end + (size - tail) : object_end;
+        }
+    }
+    scan_entry(marker, entry);
+}
+
+void marker_scan_roots(struct Marker *marker, const void *start, const void *end)
+{
+    scan(marker, start, end);
+}
+
+void marker_add_root(struct Marker *marker, void *ptr)
+{
+    add_candidate(ptr, marker);
+}
+
+void marker_flush_roots(struct Marker *marker)
+{
+    flush_candidates(marker);
+}
+
+int marker_step(struct Marker *marker, size_t budget)
+{
+    for (size_t done = 0; done < budget; done++)
+    {
+        struct MarkEntry entry;
+        if (marker->size > 0)
+        {
+            entry = marker->stack[--marker->size];
+            __builtin_prefetch(entry.start);
+            unsigned tail = (marker->fifo_head + marker->fifo_cnt) % GC_MARK_FIFO_SIZE;
+            if (marker->fifo_cnt < GC_MARK_FIFO_SIZE)
+            {
+                marker->fifo[tail] = entry;
+                marker->fifo_cnt++;
+                continue;
+            }
+            struct MarkEntry oldest = marker->fifo[marker->fifo_head];
+            marker->fifo[marker->fifo_head] = entry;
+            marker->fifo_head = (marker->fifo_head + 1) % GC_MARK_FIFO_SIZE;
+            entry = oldest;
+        }
+        else if (marker->fifo_cnt > 0)
+        {
+            entry = marker->fifo[marker->fifo_head];
+            marker->fifo_head = (marker->fifo_head + 1) % GC_MARK_FIFO_SIZE;
+            marker->fifo_cnt--;
+        }
+        else
+        {
+            return 0;
+        }
+
+        size_t chunk = GC_MARK_CHUNK;
+        if (entry.descriptor != NULL)
+        {
+            // split on element boundaries
+            chunk = chunk > entry.descriptor->size ? chunk - chunk % entry.descriptor->size : entry.descriptor->size;
+        }
+        if ((size_t)((char *)entry.end - (char *)entry.start) > chunk)
+        {
+            struct MarkEntry rest = entry;
+            rest.start = (char *)entry.start + chunk;
+            marker_push_entry(marker, rest);
+            entry.end = rest.start;
+        }
+        scan_entry(marker, entry);
+    }
+    return marker->size > 0 || marker->fifo_cnt > 0;
+}
+
+void marker_drain(struct Marker *marker)
+{
+    while (marker_step(marker, SIZE_MAX))
+    {
+    }
+}
+
+// Recovers from mark-stack overflow: every marked object is scanned again,
+// which greys the children that were dropped. Repeats until a whole pass
+// completes without overflowing. The caller must hold the heap lock.
+void marker_rescan_heap(struct Marker *marker)
+{
+    marker->range.low = marker->heap->low;
+    marker->range.high = marker->heap->high;
+    while (marker->overflowed)
+    {
+        marker->overflowed = 0;
+        for (struct Block *block = marker->heap->blocks; block != NULL; block = block->all_next)
+        {
+            if (block->kind == GC_KIND_POINTER_FREE)
+            {
+                continue;
+            }
+            for (unsigned i = 0; i < block->bump; i++)
+            {
+                unsigned char flags = block->flags[i];
+                if ((flags & GC_FLAG_ALLOCATED) && block_marked(block, i))
+                {
+                    char *start = block_object(block, i);
+                    scan_object_part(marker, block, i, start, start + block->object_size);
+                    marker_drain(marker);
+                }
+            }
+        }
+    }
+}
+
+// Remark step of a concurrent cycle: greys the children of every marked
+// object on a page written since the barrier was armed. The caller must
+// hold the heap lock with the world stopped.
+void marker_rescan_dirty(struct Marker *marker)
+{
+    marker->range.low = marker->heap->low;
+    marker->range.high = marker->heap->high;
+    for (struct Block *block = marker->heap->blocks; block != NULL; block = block->all_next)
+    {
+        if (block->kind == GC_KIND_POINTER_FREE)
+        {
+            continue;
+        }
+        if (block->size_class == GC_LARGE_CLASS)
+        {
+            if (!block_marked(block, 0))
+            {
+                continue;
+            }
+            char *end = (char *)block->start + block->object_size;
+            size_t pages = block_span(block) / GC_BLOCK_SIZE;
+            for (size_t p = 0; p < pages; p++)
+            {
+                if (block->dirty[p])
+                {
+                    char *start = (char *)block->start + p * GC_BLOCK_SIZE;
+                    scan_object_part(marker, block, 0, start, start + GC_BLOCK_SIZE < end ? start + GC_BLOCK_SIZE : end);
+                }
+            }
+            continue;
+        }
+
+        if (!block->dirty[0])
+        {
+            continue;
+        }
+        for (unsigned i = 0; i < block->bump; i++)
+        {
+            unsigned char flags = block->flags[i];
+            if ((flags & GC_FLAG_ALLOCATED) && block_marked(block, i))
+            {
+                char *start = block_object(block, i);
+                scan_object_part(marker, block, i, start, start + block->object_size);
+            }
+        }
+    }
+}
@@ -0,0 +1,129 @@
+#include "pagemap.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+
+#define TOP_SIZE (((size_t)1 << GC_PAGEMAP_TOP_BITS) * sizeof(struct Block **))
+#define LEAF_SIZE (((size_t)1 << GC_PAGEMAP_LEAF_BITS) * sizeof(struct Block *))
+
+static void *map_zeroed(size_t size)
+{
+    void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+void pagemap_init(struct PageMap *map)
+{
+    map->top = map_zeroed(TOP_SIZE);
+    if (map->top == NULL)
+    {
+        perror("pagemap_init: mmap failed");
+    }
+    map->leaf_cnt = 0;
+    map->entry_cnt = 0;
+}
+
+void pagemap_destruct(struct PageMap *map)
+{
+    if (map->top == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < ((size_t)1 << GC_PAGEMAP_TOP_BITS); i++)
+    {
+        if (map->top[i] != NULL)
+        {
+            munmap(map->top[i], LEAF_SIZE);
+        }
+    }
+    munmap(map->top, TOP_SIZE);
+    map->top = NULL;
+}
+
+int pagemap_set(struct PageMap *map, const void *start, size_t size, struct Block *block)
+{
+    uint64_t first = (uint64_t)(uintptr_t)start >> GC_BLOCK_SHIFT;
+    uint64_t last = ((uint64_t)(uintptr_t)start + size - 1) >> GC_BLOCK_SHIFT;
+    if ((last << GC_BLOCK_SHIFT) >> GC_ADDRESS_BITS || map->top == NULL)
+    {
+        return 0;
+    }
+
+    for (uint64_t page = first; page <= last; page++)
+    {
+        struct Block ***slot = &map->top[page >> GC_PAGEMAP_LEAF_BITS];
+        if (*slot == NULL)
+        {
+            if (block == NULL)
+            {
+                continue;
+            }
+            struct Block **leaf = map_zeroed(LEAF_SIZE);
+            if (leaf == NULL)
+            {
+                return 0;
+            }
+            __atomic_store_n(slot, leaf, __ATOMIC_RELEASE);
+            map->leaf_cnt++;
+        }
+
+        struct Block **entry = &(*slot)[page & ((1 << GC_PAGEMAP_LEAF_BITS) - 1)];
+        if (*entry == NULL && block != NULL)
+        {
+            map->entry_cnt++;
+        }
+        else if (*entry != NULL && block == NULL)
+        {
+            map->entry_cnt--;
+        }
+        __atomic_store_n(entry, block, __ATOMIC_RELEASE);
+    }
+    return 1;
+}
+
+// Resolves a batch of addresses level by level, prefetching each level for
+// the whole batch before it is read so that the cache misses overlap.
+void pagemap_get_many(const struct PageMap *map, void *const *ptrs, unsigned n, struct Block **out)
+{
+    for (unsigned i = 0; i < n; i++)
+    {
+        uint64_t addr = (uint64_t)(uintptr_t)ptrs[i];
+        if (!(addr >> GC_ADDRESS_BITS))
+        {
+            __builtin_prefetch(&map->top[addr >> (GC_BLOCK_SHIFT + GC_PAGEMAP_LEAF_BITS)]);
+        }
+    }
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        uint64_t addr = (uint64_t)(uintptr_t)ptrs[i];
+        struct Block **leaf = NULL;
+        if (!(addr >> GC_ADDRESS_BITS))
+        {
+            leaf = map->top[addr >> (GC_BLOCK_SHIFT + GC_PAGEMAP_LEAF_BITS)];
+        }
+        if (leaf != NULL)
+        {
+            struct Block **entry = &leaf[(addr >> GC_BLOCK_SHIFT) & ((1 << GC_PAGEMAP_LEAF_BITS) - 1)];
+            __builtin_prefetch(entry);
+            out[i] = (struct Block *)entry;
+        }
+        else
+        {
+            out[i] = NULL;
+        }
+    }
+
+    for (unsigned i = 0; i < n; i++)
+    {
+        if (out[i] != NULL)
+        {
+            out[i] = *(struct Block **)out[i];
+        }
+    }
+}
+
+size_t pagemap_overhead(const struct PageMap *map)
+{
+    return (map->leaf_cnt + 1) * GC_BLOCK_SIZE + map->entry_cnt * sizeof(struct Block *);
+}
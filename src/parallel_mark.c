@@ -0,0 +1,364 @@
+#include "parallel_mark.h"
+
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "safe_functions.h"
+#include "trace.h"
+
+static void spin_lock(int *lock)
+{
+    while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE))
+    {
+        sched_yield();
+    }
+}
+
+static void spin_unlock(int *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+// The shared queue is only ever touched by marker threads, but it is
+// mmap-backed like the mark stack so that growing it never takes a lock a
+// stopped thread might hold.
+static int reserve_shared(struct MarkWorker *worker, size_t cnt)
+{
+    if (cnt <= worker->shared_capacity)
+    {
+        return 1;
+    }
+    size_t capacity = worker->shared_capacity ? worker->shared_capacity : GC_MARK_STACK_INITIAL;
+    while (capacity < cnt)
+    {
+        capacity *= 2;
+    }
+    struct MarkEntry *shared = mmap(NULL, capacity * sizeof(struct MarkEntry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
+    {
+        return 0;
+    }
+    if (worker->shared != NULL)
+    {
+        munmap(worker->shared, worker->shared_capacity * sizeof(struct MarkEntry));
+    }
+    worker->shared = shared;
+    worker->shared_capacity = capacity;
+    return 1;
+}
+
+// Gives away the bottom half of the stack as soon as another worker is idle.
+// A depth-first mark of a tree keeps the stack about as deep as the tree, so
+// waiting for a fixed batch would leave a narrow graph to a single worker.
+// The bottom entries were pushed first, near the roots, and so usually lead
+// to the largest subgraphs.
+static void share(struct MarkWorker *worker)
+{
+    struct MarkPool *pool = worker->pool;
+    struct Marker *marker = &worker->marker;
+    if (marker->size < 2 || __atomic_load_n(&worker->shared_cnt, __ATOMIC_RELAXED) != 0 ||
+        __atomic_load_n(&pool->active, __ATOMIC_RELAXED) == (int)pool->worker_cnt)
+    {
+        return;
+    }
+
+    size_t cnt = marker->size / 2;
+    spin_lock(&worker->lock);
+    if (!reserve_shared(worker, cnt))
+    {
+        spin_unlock(&worker->lock);
+        return;
+    }
+    memcpy(worker->shared, marker->stack, cnt * sizeof(struct MarkEntry));
+    memmove(marker->stack, marker->stack + cnt, (marker->size - cnt) * sizeof(struct MarkEntry));
+    marker->size -= cnt;
+    __atomic_store_n(&worker->shared_cnt, cnt, __ATOMIC_RELEASE);
+    spin_unlock(&worker->lock);
+}
+
+static int steal(struct MarkWorker *thief, struct MarkWorker *victim)
+{
+    if (__atomic_load_n(&victim->shared_cnt, __ATOMIC_ACQUIRE) == 0)
+    {
+        return 0;
+    }
+
+    spin_lock(&victim->lock);
+    size_t cnt = victim->shared_cnt;
+    for (size_t i = 0; i < cnt; i++)
+    {
+        marker_push_entry(&thief->marker, victim->shared[i]);
+    }
+    __atomic_store_n(&victim->shared_cnt, 0, __ATOMIC_RELEASE);
+    spin_unlock(&victim->lock);
+    return cnt > 0;
+}
+
+static int steal_any(struct MarkWorker *worker)
+{
+    struct MarkPool *pool = worker->pool;
+    unsigned self = worker - pool->workers;
+    for (unsigned i = 1; i < pool->worker_cnt; i++)
+    {
+        if (steal(worker, &pool->workers[(self + i) % pool->worker_cnt]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int has_shared_work(struct MarkPool *pool)
+{
+    for (unsigned i = 0; i < pool->worker_cnt; i++)
+    {
+        if (__atomic_load_n(&pool->workers[i].shared_cnt, __ATOMIC_RELAXED) != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A worker only goes idle with its own shared queue empty, so once active
+// drops to zero no work is left anywhere.
+static void work(struct MarkWorker *worker)
+{
+    struct MarkPool *pool = worker->pool;
+    for (;;)
+    {
+        while (marker_step(&worker->marker, GC_SHARE_INTERVAL))
+        {
+            share(worker);
+        }
+        if (steal(worker, worker) || steal_any(worker))
+        {
+            continue;
+        }
+
+        __atomic_sub_fetch(&pool->active, 1, __ATOMIC_ACQ_REL);
+        for (;;)
+        {
+            if (__atomic_load_n(&pool->active, __ATOMIC_ACQUIRE) == 0)
+            {
+                return;
+            }
+            if (has_shared_work(pool))
+            {
+                __atomic_add_fetch(&pool->active, 1, __ATOMIC_ACQ_REL);
+                if (steal_any(worker))
+                {
+                    break;
+                }
+                __atomic_sub_fetch(&pool->active, 1, __ATOMIC_ACQ_REL);
+            }
+            sched_yield();
+        }
+    }
+}
+
+static void *worker_main(void *arg)
+{
+    struct MarkWorker *worker = arg;
+    struct MarkPool *pool = worker->pool;
+
+    sigset_t set;
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    unsigned seen = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        while (pool->epoch == seen && !pool->shutdown)
+        {
+            pthread_cond_wait(&pool->start_cond, &pool->lock);
+        }
+        if (pool->shutdown)
+        {
+            break;
+        }
+        seen = pool->epoch;
+        pthread_mutex_unlock(&pool->lock);
+
+        unsigned long start = trace_begin(TRACE_MARK);
+        work(worker);
+        trace_end(TRACE_MARK, start);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->finished++;
+        pthread_cond_signal(&pool->done_cond);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    trace_thread_exit();
+    return NULL;
+}
+
+void mark_pool_init(struct MarkPool *pool, struct Heap *heap, unsigned worker_cnt)
+{
+    pool->heap = heap;
+    pool->worker_cnt = worker_cnt > 0 ? worker_cnt : 1;
+    pool->workers = safe_calloc(pool->worker_cnt, sizeof(struct MarkWorker));
+
+    pool->roots_lock = 0;
+    pool->roots = NULL;
+    pool->root_cnt = 0;
+    pool->root_capacity = 0;
+
+    pool->limit = GC_MARK_STACK_LIMIT;
+    pool->unaligned = 0;
+    pool->active = 0;
+    pool->overflowed = 0;
+    pool->scanned = 0;
+
+    pool->epoch = 0;
+    pool->finished = 0;
+    pool->shutdown = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    for (unsigned i = 0; i < pool->worker_cnt; i++)
+    {
+        pool->workers[i].pool = pool;
+        marker_init(&pool->workers[i].marker, heap, pool->limit, 0);
+    }
+    for (unsigned i = 1; i < pool->worker_cnt; i++)
+    {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_main, &pool->workers[i]) != 0)
+        {
+            perror("mark_pool_init: pthread_create failed");
+            pool->worker_cnt = i;
+            break;
+        }
+    }
+}
+
+void mark_pool_destruct(struct MarkPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (unsigned i = 1; i < pool->worker_cnt; i++)
+    {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (unsigned i = 0; i < pool->worker_cnt; i++)
+    {
+        marker_destruct(&pool->workers[i].marker);
+        if (pool->workers[i].shared != NULL)
+        {
+            munmap(pool->workers[i].shared, pool->workers[i].shared_capacity * sizeof(struct MarkEntry));
+        }
+    }
+    free(pool->workers);
+
+    if (pool->roots != NULL)
+    {
+        munmap(pool->roots, pool->root_capacity * sizeof(struct MarkEntry));
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start_cond);
+    pthread_cond_destroy(&pool->done_cond);
+}
+
+// Called from root scanners, possibly inside the SIGUSR1 handler, hence the
+// spin lock and the mmap-backed root list.
+void mark_pool_donate(struct MarkPool *pool, struct Marker *marker)
+{
+    spin_lock(&pool->roots_lock);
+    if (pool->root_cnt + marker->size > pool->root_capacity)
+    {
+        size_t capacity = pool->root_capacity ? pool->root_capacity : GC_MARK_STACK_INITIAL;
+        while (capacity < pool->root_cnt + marker->size)
+        {
+            capacity *= 2;
+        }
+        struct MarkEntry *roots = mmap(NULL, capacity * sizeof(struct MarkEntry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (roots == MAP_FAILED)
+        {
+            pool->overflowed = 1;
+            spin_unlock(&pool->roots_lock);
+            return;
+        }
+        if (pool->roots != NULL)
+        {
+            memcpy(roots, pool->roots, pool->root_cnt * sizeof(struct MarkEntry));
+            munmap(pool->roots, pool->root_capacity * sizeof(struct MarkEntry));
+        }
+        pool->roots = roots;
+        pool->root_capacity = capacity;
+    }
+    memcpy(pool->roots + pool->root_cnt, marker->stack, marker->size * sizeof(struct MarkEntry));
+    pool->root_cnt += marker->size;
+    marker->size = 0;
+    spin_unlock(&pool->roots_lock);
+}
+
+// Moves the donated roots into marker, for a caller that traces them by
+// itself instead of through mark_pool_run.
+void mark_pool_take(struct MarkPool *pool, struct Marker *marker)
+{
+    spin_lock(&pool->roots_lock);
+    for (size_t i = 0; i < pool->root_cnt; i++)
+    {
+        marker_push_entry(marker, pool->roots[i]);
+    }
+    pool->root_cnt = 0;
+    if (pool->overflowed)
+    {
+        marker->overflowed = 1;
+        pool->overflowed = 0;
+    }
+    spin_unlock(&pool->roots_lock);
+}
+
+int mark_pool_run(struct MarkPool *pool, size_t limit, int unaligned)
+{
+    pthread_mutex_lock(&pool->lock);
+
+    for (unsigned i = 0; i < pool->worker_cnt; i++)
+    {
+        struct MarkWorker *worker = &pool->workers[i];
+        marker_destruct(&worker->marker);
+        marker_init(&worker->marker, pool->heap, limit, unaligned);
+        worker->lock = 0;
+        worker->shared_cnt = 0;
+    }
+    for (size_t i = 0; i < pool->root_cnt; i++)
+    {
+        marker_push_entry(&pool->workers[i % pool->worker_cnt].marker, pool->roots[i]);
+    }
+    pool->root_cnt = 0;
+
+    pool->active = pool->worker_cnt;
+    pool->finished = 0;
+    pool->epoch++;
+    pthread_cond_broadcast(&pool->start_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    work(&pool->workers[0]);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->finished < pool->worker_cnt - 1)
+    {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    int overflowed = pool->overflowed;
+    pool->overflowed = 0;
+    pool->scanned = 0;
+    for (unsigned i = 0; i < pool->worker_cnt; i++)
+    {
+        overflowed |= pool->workers[i].marker.overflowed;
+        pool->workers[i].marker.overflowed = 0;
+        pool->scanned += pool->workers[i].marker.scanned;
+    }
+    return overflowed;
+}
@@ -0,0 +1,102 @@
+#include "perf_counters.h"
+
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __linux__
+    #include <linux/perf_event.h>
+    #include <sys/syscall.h>
+#endif
+
+const char *const perf_counter_names[PERF_COUNTER_CNT] = {
+    "cycles", "instructions", "cache_misses", "dtlb_misses", "task_clock",
+};
+
+void perf_counters_init(struct PerfCounters *counters)
+{
+    for (int i = 0; i < PERF_COUNTER_CNT; i++)
+    {
+        counters->fds[i] = -1;
+    }
+}
+
+#ifdef __linux__
+
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} events[PERF_COUNTER_CNT] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+};
+
+unsigned perf_counters_open(struct PerfCounters *counters, int tid)
+{
+    unsigned opened = 0;
+    for (int i = 0; i < PERF_COUNTER_CNT; i++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        counters->fds[i] = syscall(SYS_perf_event_open, &attr, tid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (counters->fds[i] >= 0)
+        {
+            opened |= 1u << i;
+        }
+    }
+    return opened;
+}
+
+int perf_thread_id()
+{
+    return syscall(SYS_gettid);
+}
+
+#else
+
+unsigned perf_counters_open(struct PerfCounters *counters, int tid)
+{
+    (void)tid;
+    perf_counters_init(counters);
+    return 0;
+}
+
+int perf_thread_id()
+{
+    return 0;
+}
+
+#endif
+
+void perf_counters_close(struct PerfCounters *counters)
+{
+    for (int i = 0; i < PERF_COUNTER_CNT; i++)
+    {
+        if (counters->fds[i] >= 0)
+        {
+            close(counters->fds[i]);
+        }
+        counters->fds[i] = -1;
+    }
+}
+
+void perf_counters_read(const struct PerfCounters *counters, uint64_t *values)
+{
+    for (int i = 0; i < PERF_COUNTER_CNT; i++)
+    {
+        values[i] = 0;
+        if (counters->fds[i] >= 0 && read(counters->fds[i], &values[i], sizeof(values[i])) != sizeof(values[i]))
+        {
+            values[i] = 0;
+        }
+    }
+}
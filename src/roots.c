@@ -0,0 +1,169 @@
+#include "roots.h"
+#include "safe_functions.h"
+#include <string.h>
+
+static void list_init(struct RangeList *list)
+{
+    list->ranges = NULL;
+    list->cnt = 0;
+    list->capacity = 0;
+}
+
+static void list_destruct(struct RangeList *list)
+{
+    free(list->ranges);
+    list_init(list);
+}
+
+// Keeps the list sorted by start.
+static void list_insert(struct RangeList *list, char *start, char *end)
+{
+    if (list->cnt == list->capacity)
+    {
+        list->capacity = list->capacity ? 2 * list->capacity : 8;
+        list->ranges = safe_realloc(list->ranges, list->capacity * sizeof(struct RootRange));
+    }
+    size_t i = list->cnt;
+    while (i > 0 && list->ranges[i - 1].start > start)
+    {
+        list->ranges[i] = list->ranges[i - 1];
+        i--;
+    }
+    list->ranges[i].start = start;
+    list->ranges[i].end = end;
+    list->cnt++;
+}
+
+void roots_init(struct Roots *roots)
+{
+    list_init(&roots->added);
+    list_init(&roots->excluded);
+    list_init(&roots->segments);
+    roots->discover = 0;
+    roots->segments_valid = 0;
+    roots->version = 0;
+    pthread_mutex_init(&roots->lock, NULL);
+}
+
+void roots_destruct(struct Roots *roots)
+{
+    list_destruct(&roots->added);
+    list_destruct(&roots->excluded);
+    list_destruct(&roots->segments);
+    pthread_mutex_destroy(&roots->lock);
+}
+
+void roots_add(struct Roots *roots, void *start, void *end)
+{
+    if (start >= end)
+    {
+        return;
+    }
+    pthread_mutex_lock(&roots->lock);
+    list_insert(&roots->added, start, end);
+    pthread_mutex_unlock(&roots->lock);
+}
+
+void roots_remove(struct Roots *roots, void *start, void *end)
+{
+    pthread_mutex_lock(&roots->lock);
+    size_t kept = 0;
+    for (size_t i = 0; i < roots->added.cnt; i++)
+    {
+        struct RootRange range = roots->added.ranges[i];
+        if (range.start < (char *)start || range.end > (char *)end)
+        {
+            roots->added.ranges[kept++] = range;
+        }
+    }
+    roots->added.cnt = kept;
+    pthread_mutex_unlock(&roots->lock);
+}
+
+void roots_exclude(struct Roots *roots, void *start, void *end)
+{
+    if (start >= end)
+    {
+        return;
+    }
+    pthread_mutex_lock(&roots->lock);
+    list_insert(&roots->excluded, start, end);
+    pthread_mutex_unlock(&roots->lock);
+}
+
+void roots_set_discovery(struct Roots *roots, int enabled)
+{
+    pthread_mutex_lock(&roots->lock);
+    roots->discover = enabled;
+    roots->segments_valid = 0;
+    pthread_mutex_unlock(&roots->lock);
+}
+
+static void add_segment(void *start, void *end, void *ctx)
+{
+    list_insert(ctx, start, end);
+}
+
+void roots_refresh(struct Roots *roots)
+{
+    pthread_mutex_lock(&roots->lock);
+    if (roots->discover)
+    {
+        unsigned long version = get_loaded_objects_version();
+        if (!roots->segments_valid || version != roots->version)
+        {
+            roots->segments.cnt = 0;
+            for_each_writable_segment(add_segment, &roots->segments);
+            roots->version = version;
+            roots->segments_valid = 1;
+        }
+    }
+    pthread_mutex_unlock(&roots->lock);
+}
+
+static void visit_uncovered(const struct RangeList *excluded, char *start, char *end, segment_visitor visitor, void *ctx)
+{
+    for (size_t i = 0; i < excluded->cnt && start < end; i++)
+    {
+        const struct RootRange *range = &excluded->ranges[i];
+        if (range->start >= end)
+        {
+            break;
+        }
+        if (range->end <= start)
+        {
+            continue;
+        }
+        if (range->start > start)
+        {
+            visitor(start, range->start, ctx);
+        }
+        start = range->end;
+    }
+    if (start < end)
+    {
+        visitor(start, end, ctx);
+    }
+}
+
+void roots_for_each(struct Roots *roots, segment_visitor visitor, void *ctx)
+{
+    pthread_mutex_lock(&roots->lock);
+    if (roots->discover && roots->segments_valid)
+    {
+        for (size_t i = 0; i < roots->segments.cnt; i++)
+        {
+            visit_uncovered(&roots->excluded, roots->segments.ranges[i].start, roots->segments.ranges[i].end, visitor, ctx);
+        }
+    }
+    else
+    {
+        visit_uncovered(&roots->excluded, get_data_start(), get_data_end(), visitor, ctx);
+        visit_uncovered(&roots->excluded, get_bss_start(), get_bss_end(), visitor, ctx);
+    }
+    for (size_t i = 0; i < roots->added.cnt; i++)
+    {
+        visit_uncovered(&roots->excluded, roots->added.ranges[i].start, roots->added.ranges[i].end, visitor, ctx);
+    }
+    pthread_mutex_unlock(&roots->lock);
+}
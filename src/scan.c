@@ -0,0 +1,179 @@
+#include "scan.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+typedef void (*scan_kernel)(const uintptr_t *, const uintptr_t *, const struct ScanRange *, scan_visitor, void *);
+
+static void scan_scalar(const uintptr_t *start, const uintptr_t *end, const struct ScanRange *range, scan_visitor visit, void *ctx)
+{
+    uintptr_t low = range->low;
+    uintptr_t span = range->high - range->low;
+    for (const uintptr_t *i = start; i < end; i++)
+    {
+        if (*i - low < span)
+        {
+            visit((void *)*i, ctx);
+        }
+    }
+}
+
+#if defined(SCAN_X86) && defined(__x86_64__)
+
+// SSE2 has no 64-bit compare, so the unsigned test (word - low) < span is
+// assembled from 32-bit halves with their sign bits flipped.
+static void scan_sse2(const uintptr_t *start, const uintptr_t *end, const struct ScanRange *range, scan_visitor visit, void *ctx)
+{
+    const __m128i flip = _mm_set1_epi32((int)0x80000000);
+    const __m128i low = _mm_set1_epi64x((long long)range->low);
+    const __m128i span = _mm_xor_si128(_mm_set1_epi64x((long long)(range->high - range->low)), flip);
+
+    const uintptr_t *i = start;
+    for (; i + 2 <= end; i += 2)
+    {
+        __m128i words = _mm_loadu_si128((const __m128i *)i);
+        __m128i offset = _mm_xor_si128(_mm_sub_epi64(words, low), flip);
+        __m128i gt = _mm_cmpgt_epi32(span, offset);
+        __m128i eq = _mm_cmpeq_epi32(span, offset);
+        __m128i gt_hi = _mm_shuffle_epi32(gt, _MM_SHUFFLE(3, 3, 1, 1));
+        __m128i gt_lo = _mm_shuffle_epi32(gt, _MM_SHUFFLE(2, 2, 0, 0));
+        __m128i eq_hi = _mm_shuffle_epi32(eq, _MM_SHUFFLE(3, 3, 1, 1));
+        int mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_or_si128(gt_hi, _mm_and_si128(eq_hi, gt_lo))));
+        if (mask & 1)
+        {
+            visit((void *)i[0], ctx);
+        }
+        if (mask & 2)
+        {
+            visit((void *)i[1], ctx);
+        }
+    }
+    scan_scalar(i, end, range, visit, ctx);
+}
+
+__attribute__((target("avx2"))) static void scan_avx2(const uintptr_t *start, const uintptr_t *end, const struct ScanRange *range, scan_visitor visit, void *ctx)
+{
+    const __m256i flip = _mm256_set1_epi64x((long long)0x8000000000000000ULL);
+    const __m256i low = _mm256_set1_epi64x((long long)range->low);
+    const __m256i span = _mm256_xor_si256(_mm256_set1_epi64x((long long)(range->high - range->low)), flip);
+
+    const uintptr_t *i = start;
+    for (; i + 8 <= end; i += 8)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)i);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(i + 4));
+        __m256i in_a = _mm256_cmpgt_epi64(span, _mm256_xor_si256(_mm256_sub_epi64(a, low), flip));
+        __m256i in_b = _mm256_cmpgt_epi64(span, _mm256_xor_si256(_mm256_sub_epi64(b, low), flip));
+        unsigned mask = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(in_a)) |
+                        (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(in_b)) << 4;
+        while (mask)
+        {
+            unsigned bit = __builtin_ctz(mask);
+            visit((void *)i[bit], ctx);
+            mask &= mask - 1;
+        }
+    }
+    scan_scalar(i, end, range, visit, ctx);
+}
+
+#endif
+
+struct KernelEntry
+{
+    const char *name;
+    scan_kernel kernel;
+};
+
+static const struct KernelEntry kernels[] = {
+    {"scalar", scan_scalar},
+#if defined(SCAN_X86) && defined(__x86_64__)
+    {"sse2", scan_sse2},
+    {"avx2", scan_avx2},
+#endif
+};
+
+static scan_kernel kernel = scan_scalar;
+static const char *kernel_name = "scalar";
+
+void scan_init()
+{
+#if defined(SCAN_X86) && defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernel = scan_avx2;
+        kernel_name = "avx2";
+    }
+    else
+    {
+        kernel = scan_sse2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+int scan_use_kernel(const char *name)
+{
+#if defined(SCAN_X86) && defined(__x86_64__)
+    __builtin_cpu_init();
+    if (strcmp(name, "avx2") == 0 && !__builtin_cpu_supports("avx2"))
+    {
+        return 0;
+    }
+#endif
+    for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+    {
+        if (strcmp(kernels[i].name, name) == 0)
+        {
+            kernel = kernels[i].kernel;
+            kernel_name = kernels[i].name;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+const char *scan_kernel_name()
+{
+    return kernel_name;
+}
+
+static void scan_unaligned(const char *start, const char *end, const struct ScanRange *range, scan_visitor visit, void *ctx)
+{
+    uintptr_t low = range->low;
+    uintptr_t span = range->high - range->low;
+    for (const char *i = start; i + sizeof(uintptr_t) <= end; i++)
+    {
+        uintptr_t word;
+        memcpy(&word, i, sizeof(word));
+        if (word - low < span)
+        {
+            visit((void *)word, ctx);
+        }
+    }
+}
+
+void scan_words(const void *start, const void *end, const struct ScanRange *range, scan_visitor visit, void *ctx)
+{
+    if (start >= end || range->low >= range->high)
+    {
+        return;
+    }
+
+    if (range->unaligned)
+    {
+        scan_unaligned(start, end, range, visit, ctx);
+        return;
+    }
+
+    uintptr_t first = ((uintptr_t)start + sizeof(uintptr_t) - 1) & ~(uintptr_t)(sizeof(uintptr_t) - 1);
+    uintptr_t last = (uintptr_t)end & ~(uintptr_t)(sizeof(uintptr_t) - 1);
+    if (first < last)
+    {
+        kernel((const uintptr_t *)first, (const uintptr_t *)last, range, visit, ctx);
+    }
+}
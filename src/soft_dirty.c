@@ -0,0 +1,125 @@
+#include "soft_dirty.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define SOFT_DIRTY_BIT ((uint64_t)1 << 55)
+#define SOFT_DIRTY_BATCH 512
+
+static int pagemap_fd = -1;
+static int clear_refs_fd = -1;
+static size_t os_page_size;
+
+static int read_entries(uintptr_t page, uint64_t *entries, size_t cnt)
+{
+    off_t offset = (off_t)(page / os_page_size) * sizeof(uint64_t);
+    return pread(pagemap_fd, entries, cnt * sizeof(uint64_t), offset) == (ssize_t)(cnt * sizeof(uint64_t));
+}
+
+static int probe()
+{
+    volatile char *page = mmap(NULL, os_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (page == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    // kernels without CONFIG_MEM_SOFT_DIRTY accept the clear but never set the bit
+    uint64_t before, after;
+    page[0] = 1;
+    soft_dirty_clear();
+    int ok = read_entries((uintptr_t)page, &before, 1);
+    page[0] = 2;
+    ok = ok && read_entries((uintptr_t)page, &after, 1);
+
+    munmap((void *)page, os_page_size);
+    return ok && !(before & SOFT_DIRTY_BIT) && (after & SOFT_DIRTY_BIT);
+}
+
+int soft_dirty_init()
+{
+    if (pagemap_fd != -1)
+    {
+        return 1;
+    }
+
+    os_page_size = sysconf(_SC_PAGESIZE);
+    pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+    clear_refs_fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+    if (pagemap_fd != -1 && clear_refs_fd != -1 && probe())
+    {
+        return 1;
+    }
+
+    soft_dirty_destruct();
+    return 0;
+}
+
+void soft_dirty_destruct()
+{
+    if (pagemap_fd != -1)
+    {
+        close(pagemap_fd);
+    }
+    if (clear_refs_fd != -1)
+    {
+        close(clear_refs_fd);
+    }
+    pagemap_fd = -1;
+    clear_refs_fd = -1;
+}
+
+void soft_dirty_clear()
+{
+    if (write(clear_refs_fd, "4", 1) != 1)
+    {
+        perror("soft_dirty_clear: write to clear_refs failed");
+    }
+}
+
+static void collect_range(struct Heap *heap, uintptr_t start, uintptr_t end)
+{
+    uint64_t entries[SOFT_DIRTY_BATCH];
+    size_t batch_bytes = SOFT_DIRTY_BATCH * os_page_size;
+    for (uintptr_t batch = start; batch < end; batch += batch_bytes)
+    {
+        uintptr_t batch_end = end - batch < batch_bytes ? end : batch + batch_bytes;
+        size_t cnt = (batch_end - batch + os_page_size - 1) / os_page_size;
+        if (!read_entries(batch, entries, cnt))
+        {
+            // without the information every page has to be treated as written
+            for (size_t i = 0; i < cnt; i++)
+            {
+                entries[i] = SOFT_DIRTY_BIT;
+            }
+        }
+
+        for (uintptr_t p = batch; p < batch_end; p += GC_BLOCK_SIZE)
+        {
+            struct Block *block = pagemap_get(&heap->pagemap, (void *)p);
+            if (block != NULL)
+            {
+                block->dirty[(p - (uintptr_t)block->start) >> GC_BLOCK_SHIFT] = (entries[(p - batch) / os_page_size] & SOFT_DIRTY_BIT) != 0;
+            }
+        }
+    }
+}
+
+void soft_dirty_collect(struct Heap *heap)
+{
+    for (unsigned i = 0; i < heap->chunk_cnt; i++)
+    {
+        uintptr_t chunk = (uintptr_t)heap->chunks[i];
+        collect_range(heap, chunk, chunk + GC_CHUNK_BLOCKS * GC_BLOCK_SIZE);
+    }
+    for (struct Block *block = heap->blocks; block != NULL; block = block->all_next)
+    {
+        if (block->size_class == GC_LARGE_CLASS)
+        {
+            collect_range(heap, (uintptr_t)block->start, (uintptr_t)block->start + block_span(block));
+        }
+    }
+}
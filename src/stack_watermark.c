@@ -0,0 +1,143 @@
+#include "stack_watermark.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+void watermark_init(struct StackWatermark *watermark)
+{
+    watermark->copy = NULL;
+    watermark->copy_size = 0;
+    watermark->copy_capacity = 0;
+    watermark->hits = NULL;
+    watermark->hit_cnt = 0;
+    watermark->hit_capacity = 0;
+    watermark->reused = 0;
+}
+
+void watermark_destruct(struct StackWatermark *watermark)
+{
+    if (watermark->copy != NULL)
+    {
+        munmap(watermark->copy, watermark->copy_capacity);
+    }
+    if (watermark->hits != NULL)
+    {
+        munmap(watermark->hits, watermark->hit_capacity * sizeof(struct StackHit));
+    }
+    watermark_init(watermark);
+}
+
+static size_t round_to_pages(size_t size)
+{
+    return (size + GC_BLOCK_SIZE - 1) / GC_BLOCK_SIZE * GC_BLOCK_SIZE;
+}
+
+// The copy is kept aligned to its end, which stands for the stack base.
+static int reserve_copy(struct StackWatermark *watermark, size_t size)
+{
+    if (size <= watermark->copy_capacity)
+    {
+        return 1;
+    }
+    size_t capacity = round_to_pages(2 * size);
+    char *copy = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (copy == MAP_FAILED)
+    {
+        return 0;
+    }
+    if (watermark->copy != NULL)
+    {
+        memcpy(copy + capacity - watermark->copy_size, watermark->copy + watermark->copy_capacity - watermark->copy_size, watermark->copy_size);
+        munmap(watermark->copy, watermark->copy_capacity);
+    }
+    watermark->copy = copy;
+    watermark->copy_capacity = capacity;
+    return 1;
+}
+
+static int add_hit(struct StackWatermark *watermark, size_t offset, void *value)
+{
+    if (watermark->hit_cnt == watermark->hit_capacity)
+    {
+        size_t capacity = watermark->hit_capacity ? 2 * watermark->hit_capacity : GC_BLOCK_SIZE / sizeof(struct StackHit);
+        struct StackHit *hits = mmap(NULL, capacity * sizeof(struct StackHit), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (hits == MAP_FAILED)
+        {
+            return 0;
+        }
+        if (watermark->hits != NULL)
+        {
+            memcpy(hits, watermark->hits, watermark->hit_cnt * sizeof(struct StackHit));
+            munmap(watermark->hits, watermark->hit_capacity * sizeof(struct StackHit));
+        }
+        watermark->hits = hits;
+        watermark->hit_capacity = capacity;
+    }
+    watermark->hits[watermark->hit_cnt].offset = offset;
+    watermark->hits[watermark->hit_cnt].value = value;
+    watermark->hit_cnt++;
+    return 1;
+}
+
+// Length of the part next to the base that is equal to the copy, in whole
+// chunks.
+static size_t unchanged_size(const struct StackWatermark *watermark, const char *base, size_t size)
+{
+    size_t limit = size < watermark->copy_size ? size : watermark->copy_size;
+    const char *copy_end = watermark->copy + watermark->copy_capacity;
+    size_t same = 0;
+    while (same + GC_WATERMARK_CHUNK <= limit)
+    {
+        size_t next = same + GC_WATERMARK_CHUNK;
+        if (memcmp(base - next, copy_end - next, GC_WATERMARK_CHUNK) != 0)
+        {
+            break;
+        }
+        same = next;
+    }
+    return same;
+}
+
+void watermark_scan(struct StackWatermark *watermark, struct Marker *marker, const void *top, const void *base)
+{
+    const char *low = (const char *)((uintptr_t)top & ~(uintptr_t)(sizeof(void *) - 1));
+    size_t size = (const char *)base - low;
+
+    size_t same = unchanged_size(watermark, base, size);
+    size_t kept = 0;
+    while (kept < watermark->hit_cnt && watermark->hits[kept].offset <= same)
+    {
+        kept++;
+    }
+    watermark->hit_cnt = kept;
+    for (size_t i = 0; i < kept; i++)
+    {
+        marker_add_root(marker, watermark->hits[i].value);
+    }
+
+    int recording = reserve_copy(watermark, size);
+    for (const char *slot = (const char *)base - same - sizeof(void *); slot >= low; slot -= sizeof(void *))
+    {
+        void *value = *(void *const *)slot;
+        if ((uintptr_t)value >= marker->range.low && (uintptr_t)value < marker->range.high)
+        {
+            recording = recording && add_hit(watermark, (const char *)base - slot, value);
+            marker_add_root(marker, value);
+        }
+    }
+    marker_flush_roots(marker);
+
+    if (recording)
+    {
+        memcpy(watermark->copy + watermark->copy_capacity - size, low, size - same);
+        watermark->copy_size = size;
+    }
+    else
+    {
+        // without a complete record the next scan starts from scratch
+        watermark->copy_size = 0;
+        watermark->hit_cnt = 0;
+    }
+    watermark->reused = same;
+}
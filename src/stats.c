@@ -0,0 +1,85 @@
+#include "stats.h"
+
+#include <string.h>
+
+void stats_init(struct GcStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+static unsigned pause_bucket(unsigned long pause_ns)
+{
+    unsigned long us = pause_ns / 1000;
+    unsigned bucket = 0;
+    while (us != 0 && bucket < GC_PAUSE_BUCKETS - 1)
+    {
+        us >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+void stats_record(struct GcStats *stats, const struct GcCycleStats *cycle, int minor)
+{
+    struct GcCycleStats *total = &stats->total;
+    total->pause_ns += cycle->pause_ns;
+    total->stop_ns += cycle->stop_ns;
+    total->roots_ns += cycle->roots_ns;
+    total->mark_ns += cycle->mark_ns;
+    total->sweep_ns += cycle->sweep_ns;
+    total->allocated_bytes += cycle->allocated_bytes;
+    total->allocated_objects += cycle->allocated_objects;
+    total->marked_bytes += cycle->marked_bytes;
+    total->marked_objects += cycle->marked_objects;
+    total->freed_bytes += cycle->freed_bytes;
+    total->freed_objects += cycle->freed_objects;
+    total->scanned_words += cycle->scanned_words;
+    for (int phase = 0; phase < GC_COUNT_PHASE_CNT; phase++)
+    {
+        for (int i = 0; i < PERF_COUNTER_CNT; i++)
+        {
+            total->counters[phase][i] += cycle->counters[phase][i];
+        }
+    }
+
+    stats->last = *cycle;
+    stats->last_minor = minor;
+    stats->cycles++;
+    stats->minor_cycles += minor;
+    stats->pause_histogram[pause_bucket(cycle->pause_ns)]++;
+    if (cycle->pause_ns > stats->max_pause_ns)
+    {
+        stats->max_pause_ns = cycle->pause_ns;
+    }
+}
+
+static const char *const phase_names[GC_COUNT_PHASE_CNT] = {"sweep", "roots", "mark_stack", "mark"};
+
+// Times are printed in microseconds, sizes in bytes, objects after a slash.
+// The available counters follow per phase.
+void stats_log(const struct GcStats *stats, FILE *stream)
+{
+    const struct GcCycleStats *last = &stats->last;
+    fprintf(stream,
+            "gc %lu %s pause=%luus stop=%luus roots=%luus mark=%luus sweep=%luus"
+            " allocated=%zu/%zu marked=%zu/%zu freed=%zu/%zu live=%zu metadata=%zu scanned=%zu",
+            stats->cycles, stats->last_minor ? "minor" : "major",
+            last->pause_ns / 1000, last->stop_ns / 1000, last->roots_ns / 1000, last->mark_ns / 1000, last->sweep_ns / 1000,
+            last->allocated_bytes, last->allocated_objects, last->marked_bytes, last->marked_objects,
+            last->freed_bytes, last->freed_objects, stats->live_bytes, stats->metadata_bytes, last->scanned_words);
+    for (int phase = 0; stats->counters_available != 0 && phase < GC_COUNT_PHASE_CNT; phase++)
+    {
+        const char *separator = "=";
+        fprintf(stream, " perf_%s", phase_names[phase]);
+        for (int i = 0; i < PERF_COUNTER_CNT; i++)
+        {
+            if (stats->counters_available & (1u << i))
+            {
+                fprintf(stream, "%s%s:%llu", separator, perf_counter_names[i], (unsigned long long)last->counters[phase][i]);
+                separator = ",";
+            }
+        }
+    }
+    fprintf(stream, "\n");
+    fflush(stream);
+}
@@ -0,0 +1,108 @@
+#include "sweeper.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include "trace.h"
+
+static void *sweeper_main(void *arg)
+{
+    struct Sweeper *sweeper = arg;
+
+    // the barrier's SIGSEGV has to get through: sweeping writes free-list
+    // links into pages that may be write-protected
+    sigset_t set;
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    sigdelset(&set, SIGBUS);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    struct FreeBatch batch;
+    batch.cnt = 0;
+    batch.map_cnt = 0;
+
+    pthread_mutex_lock(&sweeper->lock);
+    for (;;)
+    {
+        while (sweeper->completed == sweeper->requested && !sweeper->shutdown)
+        {
+            pthread_cond_wait(&sweeper->wake_cond, &sweeper->lock);
+        }
+        if (sweeper->shutdown)
+        {
+            break;
+        }
+        unsigned request = sweeper->requested;
+        pthread_mutex_unlock(&sweeper->lock);
+
+        int more = 1;
+        while (more)
+        {
+            unsigned long start = trace_begin(TRACE_SWEEP);
+            pthread_mutex_lock(&sweeper->heap->lock);
+            more = heap_sweep_step(sweeper->heap, GC_FREE_BATCH, &batch);
+            pthread_mutex_unlock(&sweeper->heap->lock);
+            heap_free_batch(&batch);
+            trace_end(TRACE_SWEEP, start);
+        }
+
+        pthread_mutex_lock(&sweeper->lock);
+        sweeper->completed = request;
+        pthread_cond_broadcast(&sweeper->done_cond);
+    }
+    pthread_mutex_unlock(&sweeper->lock);
+    trace_thread_exit();
+    return NULL;
+}
+
+int sweeper_init(struct Sweeper *sweeper, struct Heap *heap)
+{
+    sweeper->heap = heap;
+    sweeper->requested = 0;
+    sweeper->completed = 0;
+    sweeper->shutdown = 0;
+    pthread_mutex_init(&sweeper->lock, NULL);
+    pthread_cond_init(&sweeper->wake_cond, NULL);
+    pthread_cond_init(&sweeper->done_cond, NULL);
+
+    if (pthread_create(&sweeper->thread, NULL, sweeper_main, sweeper) != 0)
+    {
+        perror("sweeper_init: pthread_create failed");
+        pthread_mutex_destroy(&sweeper->lock);
+        pthread_cond_destroy(&sweeper->wake_cond);
+        pthread_cond_destroy(&sweeper->done_cond);
+        return 0;
+    }
+    return 1;
+}
+
+void sweeper_destruct(struct Sweeper *sweeper)
+{
+    pthread_mutex_lock(&sweeper->lock);
+    sweeper->shutdown = 1;
+    pthread_cond_signal(&sweeper->wake_cond);
+    pthread_mutex_unlock(&sweeper->lock);
+
+    pthread_join(sweeper->thread, NULL);
+    pthread_mutex_destroy(&sweeper->lock);
+    pthread_cond_destroy(&sweeper->wake_cond);
+    pthread_cond_destroy(&sweeper->done_cond);
+}
+
+void sweeper_wake(struct Sweeper *sweeper)
+{
+    pthread_mutex_lock(&sweeper->lock);
+    sweeper->requested++;
+    pthread_cond_signal(&sweeper->wake_cond);
+    pthread_mutex_unlock(&sweeper->lock);
+}
+
+// Waits until everything queued before the last sweeper_wake is swept.
+void sweeper_wait(struct Sweeper *sweeper)
+{
+    pthread_mutex_lock(&sweeper->lock);
+    while (sweeper->completed != sweeper->requested)
+    {
+        pthread_cond_wait(&sweeper->done_cond, &sweeper->lock);
+    }
+    pthread_mutex_unlock(&sweeper->lock);
+}
@@ -0,0 +1,238 @@
+#include "thread_cache.h"
+
+#include <stdlib.h>
+#include "safe_functions.h"
+
+static struct Heap *cache_heap = NULL;
+static struct ThreadCache *caches = NULL;
+static unsigned generation = 0;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+static __thread struct ThreadCache *current = NULL;
+static __thread unsigned current_generation = 0;
+
+static void unlink_cache(struct ThreadCache *cache)
+{
+    if (cache->prev != NULL)
+    {
+        cache->prev->next = cache->next;
+    }
+    else
+    {
+        caches = cache->next;
+    }
+    if (cache->next != NULL)
+    {
+        cache->next->prev = cache->prev;
+    }
+}
+
+static void thread_exit(void *arg)
+{
+    struct Heap *heap = cache_heap;
+    if (heap == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    // the cache is gone if the collector was destroyed meanwhile, and its
+    // memory may belong to another thread's cache by now
+    struct ThreadCache *cache = caches;
+    while (cache != NULL && (cache != arg || !pthread_equal(cache->owner, pthread_self())))
+    {
+        cache = cache->next;
+    }
+    if (cache != NULL)
+    {
+        unlink_cache(cache);
+    }
+    pthread_mutex_unlock(&heap->lock);
+
+    if (cache != NULL)
+    {
+        for (unsigned c = 0; c < GC_SIZE_CLASS_CNT; c++)
+        {
+            heap_return(heap, cache->classes[c].cells, cache->classes[c].cnt);
+        }
+        free(cache);
+    }
+}
+
+static void create_key()
+{
+    pthread_key_create(&cache_key, thread_exit);
+}
+
+static void free_caches()
+{
+    while (caches != NULL)
+    {
+        struct ThreadCache *cache = caches;
+        caches = cache->next;
+        free(cache);
+    }
+    generation++;
+}
+
+void cache_init(struct Heap *heap)
+{
+    pthread_once(&cache_key_once, create_key);
+
+    pthread_mutex_lock(&heap->lock);
+    // caches of a collector that was never destroyed hold its cells
+    free_caches();
+    cache_heap = heap;
+    pthread_mutex_unlock(&heap->lock);
+}
+
+void cache_destruct(struct Heap *heap)
+{
+    pthread_mutex_lock(&heap->lock);
+    free_caches();
+    cache_heap = NULL;
+    pthread_mutex_unlock(&heap->lock);
+}
+
+struct ThreadCache *cache_get(struct Heap *heap)
+{
+    if (current != NULL && current_generation == generation)
+    {
+        return current;
+    }
+
+    struct ThreadCache *cache = safe_malloc(sizeof(struct ThreadCache));
+    cache->owner = pthread_self();
+    for (unsigned c = 0; c < GC_SIZE_CLASS_CNT; c++)
+    {
+        cache->classes[c].cnt = 0;
+    }
+
+    pthread_mutex_lock(&heap->lock);
+    cache->prev = NULL;
+    cache->next = caches;
+    if (caches != NULL)
+    {
+        caches->prev = cache;
+    }
+    caches = cache;
+    pthread_mutex_unlock(&heap->lock);
+
+    current = cache;
+    current_generation = generation;
+    pthread_setspecific(cache_key, cache);
+    return cache;
+}
+
+void *cache_alloc(struct Heap *heap, struct ThreadCache *cache, unsigned size_class)
+{
+    struct ClassCache *cc = &cache->classes[size_class];
+    unsigned n = cc->cnt;
+    if (n == 0)
+    {
+        // the collector holds the heap lock while the world is stopped, so
+        // the refilled cells are either all in its snapshot or none of them
+        pthread_mutex_lock(&heap->lock);
+        n = heap_take_cells(heap, size_class, cc->cells, GC_CACHE_BATCH);
+        __atomic_store_n(&cc->cnt, n, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&heap->lock);
+        if (n == 0)
+        {
+            return NULL;
+        }
+    }
+
+    void *ptr = cc->cells[n - 1];
+    struct Block *block = pagemap_get(&heap->pagemap, ptr);
+    unsigned index = ((char *)ptr - (char *)block->start) / block->object_size;
+    __atomic_store_n(&block->flags[index], GC_FLAG_ALLOCATED | GC_FLAG_ACTIVE, __ATOMIC_RELEASE);
+    if (__atomic_load_n(&heap->allocate_black, __ATOMIC_ACQUIRE))
+    {
+        block_mark(block, index);
+    }
+    __atomic_store_n(&cc->cnt, n - 1, __ATOMIC_RELEASE);
+    return ptr;
+}
+
+void cache_free(struct Heap *heap, struct ThreadCache *cache, struct Block *block, unsigned index)
+{
+    // races with the sweeper, which claims unmarked objects the same way
+    if (!(__atomic_exchange_n(&block->flags[index], 0, __ATOMIC_ACQ_REL) & GC_FLAG_ALLOCATED))
+    {
+        return;
+    }
+    block_unmark(block, index);
+    block_clear_descriptor(block, index);
+
+    // objects freed by another thread than the one that allocated them
+    // simply move to the freeing thread's cache
+    struct ClassCache *cc = &cache->classes[block->size_class];
+    unsigned n = cc->cnt;
+    if (n == GC_CACHE_CELLS)
+    {
+        n -= GC_CACHE_BATCH;
+        __atomic_store_n(&cc->cnt, n, __ATOMIC_RELEASE);
+        heap_return(heap, cc->cells + n, GC_CACHE_BATCH);
+    }
+    void *ptr = block_object(block, index);
+    cc->cells[n] = ptr;
+    __atomic_store_n(&cc->cnt, n + 1, __ATOMIC_SEQ_CST);
+
+    // a cell of a block queued for sweeping goes back to the heap: whatever
+    // it held next would have to survive that sweep unmarked. Checked only
+    // after the push, so a collection that queues the block in between has
+    // the cell in its snapshot.
+    if (__atomic_load_n(&block->sweep_pending, __ATOMIC_SEQ_CST))
+    {
+        __atomic_store_n(&cc->cnt, n, __ATOMIC_RELEASE);
+        heap_return(heap, &ptr, 1);
+    }
+}
+
+void cache_mark_cells(struct Heap *heap)
+{
+    for (struct ThreadCache *cache = caches; cache != NULL; cache = cache->next)
+    {
+        for (unsigned c = 0; c < GC_SIZE_CLASS_CNT; c++)
+        {
+            struct ClassCache *cc = &cache->classes[c];
+            unsigned n = __atomic_load_n(&cc->cnt, __ATOMIC_ACQUIRE);
+            for (unsigned i = 0; i < n; i++)
+            {
+                struct Block *block = pagemap_get(&heap->pagemap, cc->cells[i]);
+                block_mark(block, ((char *)cc->cells[i] - (char *)block->start) / block->object_size);
+            }
+        }
+    }
+}
+
+size_t cache_cell_cnt(struct Heap *heap)
+{
+    (void)heap;
+    size_t cnt = 0;
+    for (struct ThreadCache *cache = caches; cache != NULL; cache = cache->next)
+    {
+        for (unsigned c = 0; c < GC_SIZE_CLASS_CNT; c++)
+        {
+            cnt += __atomic_load_n(&cache->classes[c].cnt, __ATOMIC_ACQUIRE);
+        }
+    }
+    return cnt;
+}
+
+size_t cache_cell_bytes(struct Heap *heap, size_t *cells)
+{
+    size_t bytes = 0;
+    *cells = 0;
+    for (struct ThreadCache *cache = caches; cache != NULL; cache = cache->next)
+    {
+        for (unsigned c = 0; c < GC_SIZE_CLASS_CNT; c++)
+        {
+            unsigned n = __atomic_load_n(&cache->classes[c].cnt, __ATOMIC_ACQUIRE);
+            bytes += n * heap->classes[c].object_size;
+            *cells += n;
+        }
+    }
+    return bytes;
+}
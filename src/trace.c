@@ -0,0 +1,150 @@
+#include "trace.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// seq is the event's position in the ring plus one, stored last, so that
+// a dump can skip slots that are being overwritten.
+struct TraceEvent
+{
+    unsigned long start;
+    unsigned long end;
+    int tid;
+    unsigned phase;
+    unsigned long seq;
+};
+
+struct TraceRing
+{
+    struct TraceEvent events[GC_TRACE_EVENTS];
+    unsigned long head;
+    int owned;
+    struct TraceRing *next;
+};
+
+const char *const trace_phase_names[TRACE_PHASE_CNT] = {
+    "collect", "collect_step", "scan_threads", "mark_stack", "stopped", "mark_sections", "mark", "sweep",
+};
+int trace_enabled = 0;
+
+// Rings are never freed: a thread that is done with its ring hands it over
+// through owned, and the list only grows at the head.
+static struct TraceRing *rings = NULL;
+static __thread struct TraceRing *thread_ring = NULL;
+static __thread int thread_tid = 0;
+
+void trace_set_enabled(int enabled)
+{
+    __atomic_store_n(&trace_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+unsigned long trace_clock()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+static struct TraceRing *claim_ring()
+{
+    for (struct TraceRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        int owned = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &owned, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            return ring;
+        }
+    }
+
+    struct TraceRing *ring = mmap(NULL, sizeof(struct TraceRing), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+    {
+        return NULL;
+    }
+    ring->owned = 1;
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+    return ring;
+}
+
+void trace_record(enum TracePhase phase, unsigned long start)
+{
+    unsigned long end = trace_clock();
+    if (thread_ring == NULL)
+    {
+        thread_ring = claim_ring();
+        thread_tid = syscall(SYS_gettid);
+        if (thread_ring == NULL)
+        {
+            return;
+        }
+    }
+
+    // the signal handler may record an event in the middle of this one,
+    // so the slot is reserved in a single step
+    unsigned long slot = __atomic_fetch_add(&thread_ring->head, 1, __ATOMIC_RELAXED);
+    struct TraceEvent *event = &thread_ring->events[slot % GC_TRACE_EVENTS];
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->start = start;
+    event->end = end;
+    event->tid = thread_tid;
+    event->phase = phase;
+    __atomic_store_n(&event->seq, slot + 1, __ATOMIC_RELEASE);
+}
+
+void trace_thread_exit()
+{
+    if (thread_ring != NULL)
+    {
+        __atomic_store_n(&thread_ring->owned, 0, __ATOMIC_RELEASE);
+        thread_ring = NULL;
+    }
+}
+
+static int read_event(const struct TraceRing *ring, unsigned long slot, struct TraceEvent *event)
+{
+    const struct TraceEvent *src = &ring->events[slot % GC_TRACE_EVENTS];
+    unsigned long seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+    if (seq != slot + 1)
+    {
+        return 0;
+    }
+    event->start = src->start;
+    event->end = src->end;
+    event->tid = src->tid;
+    event->phase = src->phase;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&src->seq, __ATOMIC_RELAXED) == seq && event->phase < TRACE_PHASE_CNT;
+}
+
+void trace_dump(FILE *stream)
+{
+    int pid = getpid();
+    const char *separator = "";
+    fprintf(stream, "{\"traceEvents\":[");
+    for (struct TraceRing *ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        unsigned long slot = head > GC_TRACE_EVENTS ? head - GC_TRACE_EVENTS : 0;
+        for (; slot < head; slot++)
+        {
+            struct TraceEvent event;
+            if (!read_event(ring, slot, &event))
+            {
+                continue;
+            }
+            unsigned long duration = event.end - event.start;
+            fprintf(stream, "%s\n{\"name\":\"%s\",\"cat\":\"gc\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lu.%03lu,\"dur\":%lu.%03lu}",
+                    separator, trace_phase_names[event.phase], pid, event.tid,
+                    event.start / 1000, event.start % 1000, duration / 1000, duration % 1000);
+            separator = ",";
+        }
+    }
+    fprintf(stream, "\n]}\n");
+    fflush(stream);
+}
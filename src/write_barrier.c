@@ -0,0 +1,201 @@
+#include "write_barrier.h"
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+static struct Heap *barrier_heap = NULL;
+static struct sigaction previous_segv;
+static struct sigaction previous_bus;
+
+static int in_chunk(struct Heap *heap, uintptr_t addr)
+{
+    for (unsigned i = 0; i < heap->chunk_cnt; i++)
+    {
+        uintptr_t chunk = (uintptr_t)heap->chunks[i];
+        if (addr >= chunk && addr < chunk + GC_CHUNK_BLOCKS * GC_BLOCK_SIZE)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int record_write(struct Heap *heap, void *addr)
+{
+    if (heap == NULL || !__atomic_load_n(&heap->track_dirty, __ATOMIC_ACQUIRE))
+    {
+        return 0;
+    }
+
+    uintptr_t page = (uintptr_t)addr & ~(uintptr_t)(heap->page_size - 1);
+    int ours = 0;
+    for (uintptr_t p = page; p < page + heap->page_size; p += GC_BLOCK_SIZE)
+    {
+        struct Block *block = pagemap_get(&heap->pagemap, (void *)p);
+        if (block != NULL)
+        {
+            __atomic_store_n(&block->dirty[(p - (uintptr_t)block->start) >> GC_BLOCK_SHIFT], 1, __ATOMIC_RELAXED);
+            ours = 1;
+        }
+    }
+    if (!ours && !in_chunk(heap, (uintptr_t)addr))
+    {
+        return 0;
+    }
+    return mprotect((void *)page, heap->page_size, PROT_READ | PROT_WRITE) == 0;
+}
+
+static void forward(struct sigaction *previous, int signum, siginfo_t *info, void *context)
+{
+    if (previous->sa_flags & SA_SIGINFO)
+    {
+        previous->sa_sigaction(signum, info, context);
+    }
+    else if (previous->sa_handler == SIG_DFL || previous->sa_handler == SIG_IGN)
+    {
+        // returning re-executes the faulting instruction under the default action
+        sigaction(signum, previous, NULL);
+    }
+    else
+    {
+        previous->sa_handler(signum);
+    }
+}
+
+static void fault_handler(int signum, siginfo_t *info, void *context)
+{
+    if (record_write(barrier_heap, info->si_addr))
+    {
+        return;
+    }
+    forward(signum == SIGBUS ? &previous_bus : &previous_segv, signum, info, context);
+}
+
+// glibc fills in only the kernel's part of the old action's mask and
+// leaves stack garbage in the rest, which in these statics would be
+// scanned as roots, so the old action is copied field by field.
+static int replace_action(int signum, const struct sigaction *sa, struct sigaction *previous)
+{
+    struct sigaction old;
+    if (sigaction(signum, sa, &old) == -1)
+    {
+        return -1;
+    }
+
+    memset(previous, 0, sizeof(*previous));
+    if (old.sa_flags & SA_SIGINFO)
+    {
+        previous->sa_sigaction = old.sa_sigaction;
+    }
+    else
+    {
+        previous->sa_handler = old.sa_handler;
+    }
+    previous->sa_flags = old.sa_flags;
+    sigemptyset(&previous->sa_mask);
+    for (int sig = 1; sig < NSIG; sig++)
+    {
+        if (sigismember(&old.sa_mask, sig) == 1)
+        {
+            sigaddset(&previous->sa_mask, sig);
+        }
+    }
+    return 0;
+}
+
+void barrier_install(struct Heap *heap)
+{
+    barrier_heap = heap;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = &fault_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+
+    if (replace_action(SIGSEGV, &sa, &previous_segv) == -1 || replace_action(SIGBUS, &sa, &previous_bus) == -1)
+    {
+        perror("barrier_install: sigaction failed");
+    }
+}
+
+void barrier_uninstall()
+{
+    sigaction(SIGSEGV, &previous_segv, NULL);
+    sigaction(SIGBUS, &previous_bus, NULL);
+    barrier_heap = NULL;
+}
+
+// A page can hold several blocks; it only stays writable if none of them
+// can hold pointers.
+static int pointer_free_page(struct Heap *heap, uintptr_t page)
+{
+    for (uintptr_t p = page; p < page + heap->page_size; p += GC_BLOCK_SIZE)
+    {
+        struct Block *block = pagemap_get(&heap->pagemap, (void *)p);
+        if (block != NULL && block->kind != GC_KIND_POINTER_FREE)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Pointer-free blocks and large objects are left writable: writes to them
+// cannot hide a pointer from the marker, and the kernel may write into
+// them, which on a protected page fails with EFAULT instead of faulting.
+// Blocks set up while the barrier is armed start out dirty, so memory that
+// changes kind in the meantime is rescanned anyway.
+static void protect_all(struct Heap *heap, int prot)
+{
+    for (unsigned i = 0; i < heap->chunk_cnt; i++)
+    {
+        mprotect(heap->chunks[i], GC_CHUNK_BLOCKS * GC_BLOCK_SIZE, prot);
+    }
+    if (prot & PROT_WRITE)
+    {
+        for (struct Block *block = heap->large; block != NULL; block = block->large_next)
+        {
+            size_t span = (block->object_size + heap->page_size - 1) & ~(heap->page_size - 1);
+            mprotect(block->start, span, prot);
+        }
+        return;
+    }
+
+    for (struct Block *block = heap->blocks; block != NULL; block = block->all_next)
+    {
+        if (block->size_class == GC_LARGE_CLASS)
+        {
+            if (block->kind != GC_KIND_POINTER_FREE)
+            {
+                size_t span = (block->object_size + heap->page_size - 1) & ~(heap->page_size - 1);
+                mprotect(block->start, span, prot);
+            }
+            continue;
+        }
+        uintptr_t page = (uintptr_t)block->start & ~(uintptr_t)(heap->page_size - 1);
+        if (block->kind == GC_KIND_POINTER_FREE && pointer_free_page(heap, page))
+        {
+            mprotect((void *)page, heap->page_size, PROT_READ | PROT_WRITE);
+        }
+    }
+}
+
+void barrier_arm(struct Heap *heap)
+{
+    for (struct Block *block = heap->blocks; block != NULL; block = block->all_next)
+    {
+        memset(block->dirty, 0, block_span(block) / GC_BLOCK_SIZE);
+    }
+    __atomic_store_n(&heap->track_dirty, 1, __ATOMIC_RELEASE);
+    protect_all(heap, PROT_READ);
+}
+
+void barrier_disarm(struct Heap *heap)
+{
+    protect_all(heap, PROT_READ | PROT_WRITE);
+    __atomic_store_n(&heap->track_dirty, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,11 @@
+// Loaded with dlopen() by gc_tests; its globals are only found by root
+// discovery.
+extern "C"
+{
+    void *plugin_root = 0;
+
+    void **plugin_root_slot()
+    {
+        return &plugin_root;
+    }
+}
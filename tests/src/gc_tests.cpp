@@ -1,8 +1,11 @@
+#include <dlfcn.h>
 #include <gtest/gtest.h>
+#include <vector>
 
 extern "C"
 {
 #include "gc.h"
+#include "global.h"
 }
 
 TEST(GC, create_destruct)
@@ -216,3 +219,1395 @@ TEST(GC, multi_thread)
     ASSERT_EQ(p2->next, p3);
     ASSERT_EQ(p3->next, (struct foo *)0);
 }
+
+TEST(GC, metadata_overhead)
+{
+    gc_create();
+    gc_pause();
+
+    const int count = 10000;
+    for (int i = 0; i < count; i++)
+    {
+        gc_malloc(16);
+    }
+
+    ASSERT_EQ(get_alive_allocations(), count);
+    ASSERT_LT(get_metadata_overhead() / count, 4u);
+
+    gc_resume();
+    gc_destruct();
+}
+
+TEST(GC, size_classes_reuse)
+{
+    gc_create();
+    void *small = gc_malloc(24);
+    void *large = gc_malloc(3 * GC_BLOCK_SIZE);
+    ASSERT_EQ(get_alive_allocations(), 2);
+    gc_free(small);
+    gc_free(large);
+    ASSERT_EQ(get_alive_allocations(), 0);
+    void *again = gc_malloc(24);
+    ASSERT_EQ(again, small);
+    gc_free(again);
+    gc_destruct();
+}
+
+char *interior_small;
+char *interior_large;
+
+TEST(GC, interior_pointers)
+{
+    gc_create();
+    char *small = (char *)gc_malloc(64);
+    char *large = (char *)gc_malloc(3 * GC_BLOCK_SIZE);
+    interior_small = small + 40;
+    interior_large = large + 2 * GC_BLOCK_SIZE + 8;
+    small = 0;
+    large = 0;
+    collect_garbage();
+    ASSERT_EQ(get_alive_allocations(), 2);
+    interior_small = 0;
+    interior_large = 0;
+    gc_destruct();
+}
+
+TEST(GC, resolve_many)
+{
+    gc_create();
+    char *a = (char *)gc_malloc(32);
+    char *b = (char *)gc_malloc(5000);
+    char *c = (char *)gc_malloc(32);
+    gc_free(c);
+
+    int local;
+    void *ptrs[] = {a, b + 4999, c, &local, a + 31, b + 5000, NULL};
+    struct Block *blocks[7];
+    unsigned indices[7];
+    unsigned found = heap_resolve_many(&gc->heap, ptrs, 7, blocks, indices);
+
+    ASSERT_EQ(found, 3u);
+    ASSERT_EQ(block_object(blocks[0], indices[0]), a);
+    ASSERT_EQ(block_object(blocks[1], indices[1]), b);
+    ASSERT_EQ(block_object(blocks[2], indices[2]), a);
+
+    gc_destruct();
+}
+
+static struct foo *build_list(int length)
+{
+    struct foo *head = 0;
+    for (int i = 0; i < length; i++)
+    {
+        struct foo *node = (struct foo *)gc_malloc(sizeof(struct foo));
+        node->next = head;
+        node->val = i;
+        head = node;
+    }
+    return head;
+}
+
+struct foo *list_head;
+
+TEST(GC, long_list)
+{
+    gc_create();
+    gc_pause();
+    list_head = build_list(1000000);
+    gc_resume();
+
+    collect_garbage();
+    ASSERT_GE(get_alive_allocations(), 1000000);
+
+    list_head = 0;
+    gc_destruct();
+}
+
+TEST(GC, mark_stack_overflow)
+{
+    gc_create();
+    set_mark_stack_limit(4);
+    gc_pause();
+
+    list_head = build_list(100);
+    struct foo **wide = (struct foo **)gc_malloc(200 * sizeof(struct foo *));
+    for (int i = 0; i < 200; i++)
+    {
+        wide[i] = (struct foo *)gc_malloc(sizeof(struct foo));
+        wide[i]->next = build_list(3);
+    }
+    bssptr = (struct foo *)wide;
+    wide = 0;
+    gc_resume();
+
+    collect_garbage();
+    ASSERT_GE(get_alive_allocations(), 100 + 1 + 200 * 4);
+
+    list_head = 0;
+    bssptr = 0;
+    gc_destruct();
+}
+
+TEST(GC, parallel_mark)
+{
+    gc_create();
+    set_marker_threads(4);
+    gc_pause();
+
+    const int width = 10000;
+    struct foo **wide = (struct foo **)gc_malloc(width * sizeof(struct foo *));
+    for (int i = 0; i < width; i++)
+    {
+        wide[i] = build_list(10);
+    }
+    bssptr = (struct foo *)wide;
+    wide = 0;
+    list_head = build_list(100000);
+    gc_resume();
+
+    collect_garbage();
+    ASSERT_GE(get_alive_allocations(), 1 + width * 10 + 100000);
+    collect_garbage();
+    ASSERT_GE(get_alive_allocations(), 1 + width * 10 + 100000);
+
+    bssptr = 0;
+    list_head = 0;
+    gc_destruct();
+}
+
+struct tree
+{
+    struct tree *left;
+    struct tree *right;
+};
+
+static struct tree *build_tree(int depth)
+{
+    struct tree *node = (struct tree *)gc_malloc(sizeof(struct tree));
+    node->left = depth > 0 ? build_tree(depth - 1) : 0;
+    node->right = depth > 0 ? build_tree(depth - 1) : 0;
+    return node;
+}
+
+// A single deep tree gives the workers one root between them, so the others
+// only get to mark what the first one shares.
+TEST(GC, parallel_mark_shares_work)
+{
+    gc_create();
+    set_marker_threads(4);
+    gc_pause();
+    bssptr = (struct foo *)build_tree(18);
+    gc_resume();
+
+    collect_garbage();
+    ASSERT_GE(get_alive_allocations(), (1u << 19) - 1);
+    // the other roots are a few words, so each worker that counts must have
+    // marked a part of the tree
+    size_t total = 0;
+    for (unsigned i = 0; i < gc->mark_pool.worker_cnt; i++)
+    {
+        total += gc->mark_pool.workers[i].marker.scanned;
+    }
+    unsigned busy = 0;
+    for (unsigned i = 0; i < gc->mark_pool.worker_cnt; i++)
+    {
+        busy += gc->mark_pool.workers[i].marker.scanned > total / 16;
+    }
+    ASSERT_GT(busy, 1u);
+
+    bssptr = 0;
+    gc_destruct();
+}
+
+volatile int shuffling;
+
+// Moves nodes from the middle of the first list, which the marker reaches
+// late, to the head of the second list, which it has usually traced already.
+void *shuffle(void *arg)
+{
+    gc_register_thread();
+
+    struct foo **holder = (struct foo **)bssptr;
+    struct foo *mid = holder[0];
+    for (int i = 0; i < *(int *)arg; i++)
+    {
+        mid = mid->next;
+    }
+
+    unsigned turn = 0;
+    while (shuffling)
+    {
+        struct foo *node = mid->next;
+        if (node == 0)
+        {
+            mid->next = holder[1];
+            holder[1] = 0;
+            continue;
+        }
+        mid->next = node->next;
+        node->next = holder[1];
+        holder[1] = node;
+        node = 0;
+        if ((++turn & 63) == 0)
+        {
+            gc_malloc(sizeof(struct foo));
+        }
+    }
+
+    gc_unregister_thread();
+    return NULL;
+}
+
+TEST(GC, concurrent_mark)
+{
+    gc_create();
+    set_concurrent_marking(1);
+    set_marker_threads(2);
+    gc_pause();
+
+    const int length = 20000;
+    struct foo **holder = (struct foo **)gc_malloc(2 * sizeof(struct foo *));
+    holder[0] = build_list(length);
+    holder[1] = 0;
+    bssptr = (struct foo *)holder;
+    holder = 0;
+    gc_resume();
+
+    shuffling = 1;
+    pthread_t thread;
+    int depth = length / 2;
+    pthread_create(&thread, NULL, shuffle, &depth);
+    for (int i = 0; i < 20; i++)
+    {
+        collect_garbage();
+    }
+    shuffling = 0;
+    pthread_join(thread, NULL);
+
+    set_concurrent_marking(0);
+    collect_garbage();
+    ASSERT_GE(get_alive_allocations(), 1 + length);
+
+    holder = (struct foo **)bssptr;
+    long sum = 0;
+    int cnt = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        for (struct foo *node = holder[i]; node; node = node->next)
+        {
+            sum += node->val;
+            cnt++;
+        }
+    }
+    ASSERT_EQ(cnt, length);
+    ASSERT_EQ(sum, (long)length * (length - 1) / 2);
+
+    bssptr = 0;
+    gc_destruct();
+}
+
+TEST(GC, generational)
+{
+    gc_create();
+    set_generational(1);
+    set_major_collection_interval(100);
+    gc_pause();
+
+    struct foo **holder = (struct foo **)gc_malloc(2 * sizeof(struct foo *));
+    holder[0] = build_list(1000);
+    holder[1] = 0;
+    bssptr = (struct foo *)holder;
+    holder = 0;
+    collect_garbage();
+    const int old = get_alive_allocations();
+    ASSERT_GE(old, 1001);
+
+    for (int i = 0; i < 10000; i++)
+    {
+        gc_malloc(sizeof(struct foo));
+    }
+    collect_garbage_minor();
+    ASSERT_LT(get_alive_allocations(), old + 100);
+
+    // young objects reachable only through a write into an old one
+    ((struct foo **)bssptr)[1] = build_list(1000);
+    collect_garbage_minor();
+    ASSERT_GE(get_alive_allocations(), old + 1000);
+
+    // old garbage survives minor collections until the next major one
+    ((struct foo **)bssptr)[0] = 0;
+    collect_garbage_minor();
+    ASSERT_GE(get_alive_allocations(), old + 1000);
+    collect_garbage_major();
+    ASSERT_LT(get_alive_allocations(), old + 500);
+
+    gc_resume();
+    bssptr = 0;
+    gc_destruct();
+}
+
+// Without soft-dirty bits the generational barrier stays armed between
+// collections, so only pointer-free memory can be written by the kernel
+// until generational collection is turned off.
+TEST(GC, generational_barrier)
+{
+    gc_create();
+    set_generational(1);
+    // the barrier is what is tested, whatever the kernel supports
+    gc->soft_dirty = 0;
+    char *atomic = (char *)gc_malloc_atomic(64);
+    char *normal = (char *)gc_malloc(64);
+    collect_garbage();
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    ASSERT_EQ(write(fds[1], "0123456789", 10), 10);
+    ASSERT_EQ(read(fds[0], atomic, 5), 5);
+    errno = 0;
+    ASSERT_EQ(read(fds[0], normal, 5), -1);
+    ASSERT_EQ(errno, EFAULT);
+
+    set_generational(0);
+    ASSERT_EQ(read(fds[0], normal, 5), 5);
+    ASSERT_EQ(memcmp(atomic, "01234", 5), 0);
+    ASSERT_EQ(memcmp(normal, "56789", 5), 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    atomic = 0;
+    normal = 0;
+    gc_destruct();
+}
+
+TEST(GC, incremental_steps)
+{
+    gc_create();
+    gc_pause();
+
+    const int length = 20000;
+    struct foo **holder = (struct foo **)gc_malloc(2 * sizeof(struct foo *));
+    holder[0] = build_list(length);
+    holder[1] = 0;
+    bssptr = (struct foo *)holder;
+    for (int i = 0; i < 10000; i++)
+    {
+        gc_malloc(sizeof(struct foo));
+    }
+
+    // between the slices nodes move from the middle of the first list to
+    // the head of the second, behind the marker's back; mid is looked up
+    // after the roots were scanned so that it is not a root itself
+    ASSERT_EQ(gc_collect_step(1000), GC_PHASE_MARK);
+    struct foo *mid = holder[0];
+    for (int i = 0; i < length / 2; i++)
+    {
+        mid = mid->next;
+    }
+    int steps = 1;
+    while (gc_collect_step(1000) != GC_PHASE_IDLE)
+    {
+        for (int i = 0; i < 10 && mid->next; i++)
+        {
+            struct foo *node = mid->next;
+            mid->next = node->next;
+            node->next = holder[1];
+            holder[1] = node;
+        }
+        steps++;
+    }
+    ASSERT_GT(steps, 1);
+    mid = 0;
+    holder = 0;
+
+    ASSERT_GE(get_alive_allocations(), 1 + length);
+    ASSERT_LT(get_alive_allocations(), 1 + length + 1000);
+
+    holder = (struct foo **)bssptr;
+    long sum = 0;
+    int cnt = 0;
+    for (int i = 0; i < 2; i++)
+    {
+        for (struct foo *node = holder[i]; node; node = node->next)
+        {
+            sum += node->val;
+            cnt++;
+        }
+    }
+    ASSERT_EQ(cnt, length);
+    ASSERT_EQ(sum, (long)length * (length - 1) / 2);
+
+    gc_resume();
+    bssptr = 0;
+    gc_destruct();
+}
+
+// Pointer-free memory is left writable while the barrier is armed, so the
+// kernel can write into it; a protected page would fail read() with EFAULT.
+TEST(GC, barrier_skips_pointer_free)
+{
+    gc_create();
+    gc_pause();
+    char *small = (char *)gc_malloc_atomic(64);
+    char *large = (char *)gc_malloc_atomic(64 * 1024);
+    list_head = build_list(1000);
+    gc_resume();
+
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    ASSERT_EQ(gc_collect_step(1000), GC_PHASE_MARK);
+    ASSERT_EQ(write(fds[1], "small", 5), 5);
+    ASSERT_EQ(read(fds[0], small, 5), 5);
+    ASSERT_EQ(write(fds[1], "large", 5), 5);
+    ASSERT_EQ(read(fds[0], large + 32 * 1024, 5), 5);
+    while (gc_collect_step(1000) != GC_PHASE_IDLE)
+    {
+    }
+    ASSERT_EQ(memcmp(small, "small", 5), 0);
+    ASSERT_EQ(memcmp(large + 32 * 1024, "large", 5), 0);
+
+    close(fds[0]);
+    close(fds[1]);
+    small = 0;
+    large = 0;
+    list_head = 0;
+    gc_destruct();
+}
+
+TEST(GC, incremental_allocation)
+{
+    gc_create();
+    set_incremental(20000);
+    set_allocation_threshold(1000);
+
+    list_head = build_list(10000);
+    for (int i = 0; i < 50000; i++)
+    {
+        gc_malloc(sizeof(struct foo));
+    }
+    ASSERT_LT(get_alive_allocations(), 10000 + 25000);
+
+    long sum = 0;
+    for (struct foo *node = list_head; node; node = node->next)
+    {
+        sum += node->val;
+    }
+    ASSERT_EQ(sum, 10000L * 9999 / 2);
+
+    list_head = 0;
+    gc_destruct();
+}
+
+TEST(GC, lazy_sweep)
+{
+    gc_create();
+    gc_pause();
+
+    for (int i = 0; i < 10000; i++)
+    {
+        gc_malloc(48);
+    }
+    unsigned chunks = gc->heap.chunk_cnt;
+    collect_garbage();
+
+    // the collection only queued the blocks, allocations sweep them
+    struct SizeClass *sc = &gc->heap.classes[2];
+    ASSERT_EQ(sc->object_size, 48u);
+    ASSERT_NE(sc->unswept, (struct Block *)0);
+    for (int i = 0; i < 5000; i++)
+    {
+        gc_malloc(48);
+    }
+    ASSERT_EQ(gc->heap.chunk_cnt, chunks);
+    ASSERT_LT(get_alive_allocations(), 5000 + 100);
+    ASSERT_EQ(sc->unswept, (struct Block *)0);
+
+    gc_resume();
+    gc_destruct();
+}
+
+TEST(GC, background_sweep)
+{
+    gc_create();
+    set_background_sweep(1);
+    set_generational(1);
+    gc_pause();
+
+    list_head = build_list(1000);
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i = 0; i < 10000; i++)
+        {
+            gc_malloc(48);
+        }
+        gc_malloc(3 * GC_BLOCK_SIZE);
+        collect_garbage_major();
+
+        // with the barrier armed the sweeper writes into protected pages
+        sweeper_wait(&gc->sweeper);
+        for (int i = 0; i < GC_SIZE_CLASS_CNT; i++)
+        {
+            ASSERT_EQ(gc->heap.classes[i].unswept, (struct Block *)0);
+        }
+        ASSERT_EQ(gc->heap.unswept_large, (struct Block *)0);
+        ASSERT_LT(gc->heap.object_cnt, 1000u + 100);
+    }
+
+    long sum = 0;
+    for (struct foo *node = list_head; node; node = node->next)
+    {
+        sum += node->val;
+    }
+    ASSERT_EQ(sum, 1000L * 999 / 2);
+
+    gc_resume();
+    list_head = 0;
+    gc_destruct();
+}
+
+TEST(GC, side_mark_bitmaps)
+{
+    gc_create();
+    gc_pause();
+
+    list_head = build_list(1000);
+    struct Block *block;
+    unsigned index;
+    ASSERT_TRUE(heap_find_object(&gc->heap, list_head, &block, &index));
+    unsigned char flags[GC_BLOCK_SIZE / GC_GRANULE];
+    memcpy(flags, block->flags, block->object_cnt);
+
+    collect_garbage();
+
+    // marking goes to the bitmap only, the descriptor stays untouched
+    ASSERT_TRUE(block_marked(block, index));
+    ASSERT_EQ(memcmp(flags, block->flags, block->object_cnt), 0);
+    heap_clear_marks(&gc->heap);
+    ASSERT_FALSE(block_marked(block, index));
+
+    gc_resume();
+    list_head = 0;
+    gc_destruct();
+}
+
+#define CACHE_THREADS 4
+
+struct foo *cache_lists[CACHE_THREADS];
+void *foreign[CACHE_THREADS][256];
+volatile int cache_done = 0;
+
+void *cache_worker(void *arg)
+{
+    gc_register_thread();
+    long id = (long)arg;
+    for (int i = 0; i < 5000; i++)
+    {
+        struct foo *node = (struct foo *)gc_malloc(sizeof(struct foo));
+        node->val = i;
+        node->next = cache_lists[id];
+        cache_lists[id] = node;
+        gc_malloc(sizeof(struct foo));
+        if (i < 256)
+        {
+            // objects allocated by the main thread, freed here
+            gc_free(foreign[id][i]);
+        }
+    }
+    __atomic_fetch_add(&cache_done, 1, __ATOMIC_SEQ_CST);
+    gc_unregister_thread();
+    return NULL;
+}
+
+static unsigned long cycles()
+{
+    struct GcStats stats;
+    gc_get_stats(&stats);
+    return stats.cycles;
+}
+
+TEST(GC, allocation_threshold)
+{
+    gc_create();
+    set_allocation_threshold(10);
+
+    // counts this thread has not reported yet may be left from before
+    unsigned long start = cycles();
+    while (cycles() == start)
+    {
+        gc_malloc(sizeof(struct foo));
+    }
+    start = cycles();
+    for (int i = 0; i < 10; i++)
+    {
+        gc_malloc(sizeof(struct foo));
+    }
+    ASSERT_EQ(cycles(), start);
+    gc_malloc(sizeof(struct foo));
+    ASSERT_EQ(cycles(), start + 1);
+
+    gc_destruct();
+}
+
+TEST(GC, thread_caches)
+{
+    gc_create();
+    set_allocation_threshold(2000);
+    cache_done = 0;
+
+    for (int t = 0; t < CACHE_THREADS; t++)
+    {
+        cache_lists[t] = 0;
+        for (int i = 0; i < 256; i++)
+        {
+            foreign[t][i] = gc_malloc(sizeof(struct foo));
+        }
+    }
+
+    pthread_t threads[CACHE_THREADS];
+    for (long t = 0; t < CACHE_THREADS; t++)
+    {
+        pthread_create(&threads[t], NULL, cache_worker, (void *)t);
+    }
+    while (__atomic_load_n(&cache_done, __ATOMIC_SEQ_CST) < CACHE_THREADS)
+    {
+        collect_garbage();
+        usleep(100);
+    }
+    for (int t = 0; t < CACHE_THREADS; t++)
+    {
+        pthread_join(threads[t], NULL);
+    }
+    memset(foreign, 0, sizeof(foreign));
+    collect_garbage();
+
+    for (int t = 0; t < CACHE_THREADS; t++)
+    {
+        long sum = 0;
+        for (struct foo *node = cache_lists[t]; node; node = node->next)
+        {
+            sum += node->val;
+        }
+        ASSERT_EQ(sum, 5000L * 4999 / 2);
+    }
+    // stale words on the main thread's stack may keep a few junk objects
+    ASSERT_GE(get_alive_allocations(), CACHE_THREADS * 5000);
+    ASSERT_LT(get_alive_allocations(), CACHE_THREADS * 5000 + 16);
+
+    // a freed cell comes straight back from the thread's cache
+    void *ptr = gc_malloc(sizeof(struct foo));
+    gc_free(ptr);
+    ASSERT_EQ(gc_malloc(sizeof(struct foo)), ptr);
+
+    for (int t = 0; t < CACHE_THREADS; t++)
+    {
+        cache_lists[t] = 0;
+    }
+    gc_destruct();
+}
+
+int blocking_pipe[2];
+volatile int blocking_entered = 0;
+volatile long blocking_sum = 0;
+volatile ssize_t blocking_read = 0;
+
+static long list_sum(struct foo *node)
+{
+    long sum = 0;
+    for (; node; node = node->next)
+    {
+        sum += node->val;
+    }
+    return sum;
+}
+
+void *blocking_worker(void *arg)
+{
+    (void)arg;
+    gc_register_thread();
+    struct foo *volatile head = build_list(1000);
+
+    char c;
+    gc_enter_blocking();
+    blocking_entered = 1;
+    blocking_read = read(blocking_pipe[0], &c, 1);
+    gc_leave_blocking();
+
+    blocking_sum = list_sum(head);
+    gc_unregister_thread();
+    return NULL;
+}
+
+TEST(GC, blocking_region)
+{
+    gc_create();
+    blocking_entered = 0;
+    ASSERT_EQ(pipe(blocking_pipe), 0);
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, blocking_worker, NULL);
+    while (!blocking_entered)
+    {
+        usleep(1000);
+    }
+
+    // the thread is scanned from the stack it published, not signalled,
+    // so its read() is not interrupted
+    for (int i = 0; i < 5; i++)
+    {
+        collect_garbage();
+    }
+    ASSERT_GE(get_alive_allocations(), 1000);
+
+    ASSERT_EQ(write(blocking_pipe[1], "x", 1), 1);
+    pthread_join(thread, NULL);
+    ASSERT_EQ(blocking_read, 1);
+    ASSERT_EQ(blocking_sum, 1000L * 999 / 2);
+
+    close(blocking_pipe[0]);
+    close(blocking_pipe[1]);
+    gc_destruct();
+}
+
+volatile int polling = 0;
+volatile long polling_sum = 0;
+
+void *polling_worker(void *arg)
+{
+    (void)arg;
+    // only the safepoint can stop this thread
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    gc_register_thread();
+    struct foo *volatile head = build_list(1000);
+    polling = 1;
+    while (polling)
+    {
+        gc_safepoint();
+    }
+    polling_sum = list_sum(head);
+    gc_unregister_thread();
+    return NULL;
+}
+
+TEST(GC, safepoint_polling)
+{
+    gc_create();
+    set_safepoint_polling(1000000000UL);
+    polling = 0;
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, polling_worker, NULL);
+    while (!polling)
+    {
+        usleep(1000);
+    }
+
+    collect_garbage();
+    collect_garbage();
+    ASSERT_LT(get_time_to_safepoint(), 1000000000UL);
+    ASSERT_GE(get_max_time_to_safepoint(), get_time_to_safepoint());
+
+    polling = 0;
+    pthread_join(thread, NULL);
+    ASSERT_EQ(polling_sum, 1000L * 999 / 2);
+    gc_destruct();
+}
+
+#define POLLING_THREADS 4
+
+int polling_ready = 0;
+volatile int polling_stop = 0;
+long polling_sums[POLLING_THREADS];
+
+// Parked threads must stay stopped for the whole collection: one that went
+// on running would have to be signalled, which it never answers.
+void *polling_many_worker(void *arg)
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    gc_register_thread();
+    struct foo *volatile head = build_list(1000);
+    __atomic_add_fetch(&polling_ready, 1, __ATOMIC_RELEASE);
+    while (!polling_stop)
+    {
+        gc_safepoint();
+    }
+    polling_sums[(long)arg] = list_sum(head);
+    gc_unregister_thread();
+    return NULL;
+}
+
+TEST(GC, safepoint_polling_threads)
+{
+    gc_create();
+    set_safepoint_polling(1000000000UL);
+    polling_ready = 0;
+    polling_stop = 0;
+
+    pthread_t threads[POLLING_THREADS];
+    for (long t = 0; t < POLLING_THREADS; t++)
+    {
+        pthread_create(&threads[t], NULL, polling_many_worker, (void *)t);
+    }
+    while (__atomic_load_n(&polling_ready, __ATOMIC_ACQUIRE) < POLLING_THREADS)
+    {
+        usleep(1000);
+    }
+
+    for (int i = 0; i < 20; i++)
+    {
+        collect_garbage();
+        build_list(100);
+    }
+    ASSERT_LT(get_max_time_to_safepoint(), 1000000000UL);
+
+    polling_stop = 1;
+    for (int t = 0; t < POLLING_THREADS; t++)
+    {
+        pthread_join(threads[t], NULL);
+        ASSERT_EQ(polling_sums[t], 1000L * 999 / 2);
+    }
+    gc_destruct();
+}
+
+size_t watermark_reused = 0;
+long watermark_sum = 0;
+
+static void __attribute__((noinline)) replace_list(struct foo *volatile *slot)
+{
+    *slot = build_list(500);
+}
+
+static void __attribute__((noinline)) watermark_descend(int depth, struct foo *volatile *slot)
+{
+    volatile char pad[256];
+    pad[0] = (char)depth;
+    if (depth > 0)
+    {
+        watermark_descend(depth - 1, slot);
+        pad[1] = pad[0];
+        return;
+    }
+
+    collect_garbage();
+    size_t before = get_stack_bytes_reused();
+    collect_garbage();
+    watermark_reused = get_stack_bytes_reused() - before;
+
+    // Changes a frame far below the watermark of the last scan.
+    replace_list(slot);
+    collect_garbage();
+    build_list(2000);
+    collect_garbage();
+    watermark_sum = list_sum(*slot);
+}
+
+TEST(GC, stack_watermark)
+{
+    gc_create();
+    struct foo *volatile head = build_list(1000);
+    watermark_descend(64, &head);
+
+    ASSERT_GT(watermark_reused, 64 * 256);
+    ASSERT_EQ(watermark_sum, 500L * 499 / 2);
+    gc_destruct();
+}
+
+#define ROOT_OBJECTS 64
+
+struct foo *excluded_roots[ROOT_OBJECTS];
+
+static void __attribute__((noinline)) fill_roots(struct foo **roots)
+{
+    for (int i = 0; i < ROOT_OBJECTS; i++)
+    {
+        roots[i] = (struct foo *)gc_malloc(sizeof(struct foo));
+        roots[i]->next = 0;
+        roots[i]->val = i;
+    }
+}
+
+TEST(GC, root_ranges)
+{
+    gc_create();
+    struct foo **added = (struct foo **)malloc(ROOT_OBJECTS * sizeof(struct foo *));
+    gc_add_roots(added, added + ROOT_OBJECTS);
+    fill_roots(added);
+    gc_exclude_range(excluded_roots, excluded_roots + ROOT_OBJECTS);
+    fill_roots(excluded_roots);
+
+    collect_garbage();
+    ASSERT_GE(get_alive_allocations(), ROOT_OBJECTS);
+    ASSERT_LT(get_alive_allocations(), ROOT_OBJECTS + ROOT_OBJECTS / 2);
+
+    gc_remove_roots(added, added + ROOT_OBJECTS);
+    collect_garbage();
+    ASSERT_LT(get_alive_allocations(), ROOT_OBJECTS / 2);
+
+    memset(excluded_roots, 0, sizeof(excluded_roots));
+    free(added);
+    gc_destruct();
+}
+
+static void __attribute__((noinline)) store_plugin_list(void **slot)
+{
+    *slot = build_list(1000);
+}
+
+TEST(GC, root_discovery)
+{
+    gc_create();
+    set_root_discovery(1);
+    // takes the segments before the plugin is loaded
+    collect_garbage();
+
+    void *plugin = dlopen(GC_TEST_PLUGIN, RTLD_NOW);
+    ASSERT_NE(plugin, nullptr);
+    void **(*root_slot)() = (void **(*)())dlsym(plugin, "plugin_root_slot");
+    ASSERT_NE(root_slot, nullptr);
+    void **slot = root_slot();
+
+    store_plugin_list(slot);
+    collect_garbage();
+    build_list(2000);
+    collect_garbage();
+    ASSERT_GE(get_alive_allocations(), 1000);
+    ASSERT_EQ(list_sum((struct foo *)*slot), 1000L * 999 / 2);
+
+    *slot = 0;
+    dlclose(plugin);
+    gc_destruct();
+}
+
+#define ATOMIC_SLOTS 16
+
+static void __attribute__((noinline)) fill_atomic(void **slots)
+{
+    for (int i = 0; i < ATOMIC_SLOTS; i++)
+    {
+        slots[i] = gc_malloc(sizeof(struct foo));
+    }
+}
+
+static int pointer_free(void *ptr)
+{
+    struct Block *block;
+    unsigned index;
+    return heap_find_object(&gc->heap, ptr, &block, &index) && block->kind == GC_KIND_POINTER_FREE;
+}
+
+TEST(GC, atomic_allocations)
+{
+    gc_create();
+    void **volatile small = (void **)gc_malloc_atomic(ATOMIC_SLOTS * sizeof(void *));
+    void **volatile large = (void **)gc_calloc_atomic(2 * GC_BLOCK_SIZE, 1);
+    fill_atomic(small);
+    fill_atomic(large);
+
+    // the objects referenced only from pointer-free memory are reclaimed
+    collect_garbage();
+    ASSERT_GE(get_alive_allocations(), 2);
+    ASSERT_LT(get_alive_allocations(), 2 + ATOMIC_SLOTS);
+    ASSERT_TRUE(pointer_free(small));
+    ASSERT_TRUE(pointer_free(large));
+
+    small = (void **)gc_realloc(small, 3 * GC_BLOCK_SIZE);
+    ASSERT_TRUE(pointer_free(small));
+    large = (void **)gc_realloc(large, 64);
+    ASSERT_TRUE(pointer_free(large));
+    ASSERT_FALSE(pointer_free(gc_realloc(gc_malloc(16), 2 * GC_BLOCK_SIZE)));
+
+    gc_destruct();
+}
+
+struct typed_node
+{
+    struct typed_node *next;
+    uintptr_t hidden;
+    long val;
+};
+
+#define TYPED_LIST 1000
+#define TYPED_ARRAY 600
+
+// Every node also hides the address of an object in a word its
+// descriptor does not list, which must not keep that object alive.
+static struct typed_node *__attribute__((noinline)) build_typed(const struct GcDescriptor *descriptor, struct typed_node **array)
+{
+    struct typed_node *head = 0;
+    for (int i = 0; i < TYPED_LIST; i++)
+    {
+        struct typed_node *node = (struct typed_node *)gc_malloc_typed(sizeof(struct typed_node), descriptor);
+        node->next = head;
+        node->hidden = (uintptr_t)gc_malloc(16);
+        node->val = i;
+        head = node;
+    }
+
+    *array = (struct typed_node *)gc_malloc_typed(TYPED_ARRAY * sizeof(struct typed_node), descriptor);
+    for (int i = 0; i < TYPED_ARRAY; i++)
+    {
+        (*array)[i].next = (struct typed_node *)gc_malloc(sizeof(struct typed_node));
+        (*array)[i].next->val = i;
+        (*array)[i].hidden = (uintptr_t)gc_malloc(16);
+    }
+    return head;
+}
+
+TEST(GC, typed_allocations)
+{
+    gc_create();
+    const size_t offsets[] = {offsetof(struct typed_node, next)};
+    struct GcDescriptor *descriptor = GC_MAKE_DESCRIPTOR(struct typed_node, offsets);
+    ASSERT_EQ(descriptor->bitmap[0], 1u);
+
+    struct typed_node *volatile array;
+    struct typed_node *volatile head = build_typed(descriptor, (struct typed_node **)&array);
+
+    collect_garbage();
+    build_list(2000);
+    collect_garbage();
+    ASSERT_GE(get_alive_allocations(), TYPED_LIST + 1 + TYPED_ARRAY);
+    ASSERT_LT(get_alive_allocations(), TYPED_LIST + 1 + TYPED_ARRAY + 100);
+
+    long sum = 0;
+    for (struct typed_node *node = head; node; node = node->next)
+    {
+        sum += node->val;
+    }
+    ASSERT_EQ(sum, TYPED_LIST * (TYPED_LIST - 1L) / 2);
+    for (int i = 0; i < TYPED_ARRAY; i++)
+    {
+        ASSERT_EQ(array[i].next->val, i);
+    }
+
+    head = 0;
+    array = 0;
+    gc_destruct();
+    gc_free_descriptor(descriptor);
+}
+
+static int __attribute__((noinline)) allocate_mapped(size_t size, int cnt)
+{
+    int mapped = 0;
+    for (int i = 0; i < cnt; i++)
+    {
+        void *ptr = gc_malloc(size);
+        memset(ptr, 1, size);
+        struct Block *block;
+        unsigned index;
+        mapped += heap_find_object(&gc->heap, ptr, &block, &index) && block->mapped;
+    }
+    return mapped;
+}
+
+TEST(GC, mapped_large_objects)
+{
+    gc_create();
+    gc_pause();
+    set_large_object_threshold(64 * 1024);
+
+    ASSERT_EQ(allocate_mapped(32 * 1024, 1), 0);
+    ASSERT_EQ(allocate_mapped(1 << 20, 8), 8);
+    ASSERT_GE(gc->heap.mapped_bytes, (size_t)8 << 20);
+    void *volatile kept = gc_malloc(128 * 1024);
+
+    // the dead mappings are unmapped as the collection ends, not by a later
+    // sweep
+    collect_garbage();
+    ASSERT_GE(gc->heap.mapped_bytes, (size_t)128 * 1024);
+    ASSERT_LE(gc->heap.mapped_bytes, (size_t)128 * 1024 + (1 << 20));
+
+    kept = 0;
+    gc_destruct();
+}
+
+static void __attribute__((noinline)) allocate_garbage(size_t size, int cnt)
+{
+    for (int i = 0; i < cnt; i++)
+    {
+        memset(gc_malloc_atomic(size), 1, size);
+    }
+}
+
+TEST(GC, byte_trigger)
+{
+    gc_create();
+    set_heap_limits(1 << 20, SIZE_MAX);
+    void *volatile kept = gc_malloc_atomic(512 * 1024);
+
+    // nothing is live before the first cycle, so it starts after min_heap
+    ASSERT_EQ(get_live_bytes(), 0u);
+    allocate_garbage(64 * 1024, 64);
+    ASSERT_GE(get_live_bytes(), (size_t)512 * 1024);
+    ASSERT_GE(get_live_bytes() + get_trigger_bytes(), (size_t)1 << 20);
+
+    set_heap_growth(50);
+    collect_garbage();
+    ASSERT_GE(get_trigger_bytes(), get_live_bytes() / 2);
+
+    // with the heap full the next cycle comes after the minimal allowance
+    set_heap_limits(512 * 1024, 512 * 1024);
+    ASSERT_EQ(get_trigger_bytes(), GC_MIN_ALLOWANCE);
+
+    kept = 0;
+    gc_destruct();
+}
+
+TEST(GC, collector_stats)
+{
+    gc_create();
+    FILE *log = tmpfile();
+    set_gc_log(log);
+    void *volatile kept = gc_malloc_atomic(64 * 1024);
+
+    allocate_garbage(1024, 256);
+    collect_garbage();
+    collect_garbage();
+
+    struct GcStats stats;
+    gc_get_stats(&stats);
+    ASSERT_EQ(stats.cycles, 2u);
+    ASSERT_GE(stats.total.allocated_bytes, (size_t)256 * 1024);
+    ASSERT_GE(stats.total.allocated_objects, 256u);
+    ASSERT_GE(stats.total.freed_objects, 200u);
+    ASSERT_GE(stats.last.marked_bytes, (size_t)64 * 1024);
+    ASSERT_EQ(stats.live_bytes, get_live_bytes());
+    ASSERT_GE(stats.total.pause_ns, stats.last.pause_ns);
+    ASSERT_GE(stats.max_pause_ns, stats.last.pause_ns);
+    ASSERT_GE(stats.last.pause_ns, stats.last.stop_ns);
+
+    unsigned long pauses = 0;
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++)
+    {
+        pauses += stats.pause_histogram[i];
+    }
+    ASSERT_EQ(pauses, stats.cycles);
+
+    set_gc_log(NULL);
+    rewind(log);
+    char line[512];
+    int lines = 0;
+    while (fgets(line, sizeof(line), log) != NULL)
+    {
+        ASSERT_EQ(strncmp(line, "gc ", 3), 0);
+        lines++;
+    }
+    ASSERT_EQ(lines, 2);
+    fclose(log);
+
+    kept = 0;
+    gc_destruct();
+}
+
+#define CACHED_OBJECTS 20
+#define CACHED_SIZE 700
+
+void *cached_objects[CACHED_OBJECTS];
+
+// Free cells wait in the thread cache, marked so that the sweep leaves
+// them there, but they are not live data.
+TEST(GC, live_bytes_exclude_cached_cells)
+{
+    gc_create();
+    for (int i = 0; i < CACHED_OBJECTS; i++)
+    {
+        cached_objects[i] = gc_malloc(CACHED_SIZE);
+    }
+    collect_garbage();
+    size_t before = get_live_bytes();
+    ASSERT_GE(before, (size_t)CACHED_OBJECTS * CACHED_SIZE);
+
+    for (int i = 0; i < CACHED_OBJECTS; i++)
+    {
+        gc_free(cached_objects[i]);
+        cached_objects[i] = 0;
+    }
+    collect_garbage();
+    // the freed cells and the rest of the refill stay cached; a few
+    // objects may be held by stale copies on the stack
+    ASSERT_LT(get_live_bytes(), (size_t)4 * CACHED_SIZE);
+    ASSERT_LT(before, (size_t)(CACHED_OBJECTS + 4) * 1024);
+
+    struct GcStats stats;
+    gc_get_stats(&stats);
+    ASSERT_EQ(stats.last.marked_bytes, get_live_bytes());
+    gc_destruct();
+}
+
+TEST(GC, perf_counters)
+{
+    gc_create();
+    // the counters the kernel or the CPU refuses are left out, not an error
+    unsigned available = set_perf_counters(1);
+    void *volatile kept = gc_malloc(64 * 1024);
+    collect_garbage();
+
+    struct GcStats stats;
+    gc_get_stats(&stats);
+    ASSERT_EQ(stats.counters_available, available);
+    ASSERT_GE(stats.last.scanned_words, (size_t)64 * 1024 / sizeof(void *));
+    for (int phase = 0; phase < GC_COUNT_PHASE_CNT; phase++)
+    {
+        for (int i = 0; i < PERF_COUNTER_CNT; i++)
+        {
+            if (!(available & (1u << i)))
+            {
+                ASSERT_EQ(stats.last.counters[phase][i], 0u);
+            }
+        }
+    }
+    if (available & (1u << PERF_TASK_CLOCK))
+    {
+        ASSERT_GT(stats.last.counters[GC_COUNT_MARK_STACK][PERF_TASK_CLOCK], 0u);
+        ASSERT_GT(stats.last.counters[GC_COUNT_ROOTS][PERF_TASK_CLOCK], 0u);
+    }
+
+    ASSERT_EQ(set_perf_counters(0), 0u);
+    collect_garbage();
+    gc_get_stats(&stats);
+    for (int i = 0; i < PERF_COUNTER_CNT; i++)
+    {
+        ASSERT_EQ(stats.last.counters[GC_COUNT_MARK_STACK][i], 0u);
+    }
+
+    kept = 0;
+    gc_destruct();
+}
+
+static void __attribute__((noinline)) allocate_dropped(int cnt)
+{
+    for (int i = 0; i < cnt; i++)
+    {
+        gc_malloc(24);
+    }
+}
+
+TEST(GC, allocation_trace)
+{
+    gc_create();
+    FILE *stream = tmpfile();
+    set_allocation_trace(stream);
+    void *volatile kept = gc_malloc(32);
+    gc_free(gc_calloc(4, 8));
+    void *volatile grown = gc_realloc(gc_malloc_atomic(16), 4096);
+    allocate_dropped(100);
+    collect_garbage();
+    set_allocation_trace(NULL);
+    // not traced any more
+    gc_malloc(8);
+
+    rewind(stream);
+    ASSERT_TRUE(alloc_trace_read_header(stream));
+    std::vector<struct AllocEvent> events;
+    struct AllocEvent event;
+    while (alloc_trace_read_event(stream, &event))
+    {
+        events.push_back(event);
+    }
+    fclose(stream);
+
+    ASSERT_GE(events.size(), 6u + 100u);
+    ASSERT_EQ(events[0].type, GC_EVENT_MALLOC);
+    ASSERT_EQ(events[0].variant, (unsigned)GC_KIND_NORMAL);
+    ASSERT_EQ(events[0].id, 0u);
+    ASSERT_EQ(events[0].size, 32u);
+    ASSERT_EQ(events[0].thread, (unsigned)perf_thread_id());
+    ASSERT_EQ(events[1].type, GC_EVENT_CALLOC);
+    ASSERT_EQ(events[1].id, 1u);
+    ASSERT_EQ(events[1].size, 32u);
+    ASSERT_EQ(events[2].type, GC_EVENT_FREE);
+    ASSERT_EQ(events[2].id, 1u);
+    // the id of the freed object is given out again
+    ASSERT_EQ(events[3].type, GC_EVENT_MALLOC);
+    ASSERT_EQ(events[3].variant, (unsigned)GC_KIND_POINTER_FREE);
+    ASSERT_EQ(events[3].id, 1u);
+    ASSERT_EQ(events[4].type, GC_EVENT_REALLOC);
+    ASSERT_EQ(events[4].id, 1u);
+    ASSERT_EQ(events[4].size, 4096u);
+
+    size_t allocations = 0, collections = 0, deaths = 0;
+    for (size_t i = 5; i < events.size(); i++)
+    {
+        allocations += events[i].type == GC_EVENT_MALLOC;
+        collections += events[i].type == GC_EVENT_COLLECT;
+        if (events[i].type == GC_EVENT_DEATH)
+        {
+            ASSERT_GE(events[i].id, 2u);
+            deaths++;
+        }
+    }
+    ASSERT_EQ(allocations, 100u);
+    ASSERT_EQ(collections, 1u);
+    ASSERT_GE(deaths, 90u);
+
+    kept = 0;
+    grown = 0;
+    gc_destruct();
+}
+
+// The background sweeper may free the dropped objects before the deaths
+// are written, which must not make them look alive.
+TEST(GC, allocation_trace_background_sweep)
+{
+    gc_create();
+    set_background_sweep(1);
+    FILE *stream = tmpfile();
+    set_allocation_trace(stream);
+    allocate_dropped(1000);
+    collect_garbage();
+    sweeper_wait(&gc->sweeper);
+    collect_garbage();
+    set_allocation_trace(NULL);
+
+    rewind(stream);
+    ASSERT_TRUE(alloc_trace_read_header(stream));
+    size_t deaths = 0;
+    struct AllocEvent event;
+    while (alloc_trace_read_event(stream, &event))
+    {
+        deaths += event.type == GC_EVENT_DEATH;
+    }
+    fclose(stream);
+    ASSERT_GE(deaths, 990u);
+
+    gc_destruct();
+}
+
+TEST(GC, phase_tracing)
+{
+    gc_create();
+    set_tracing(1);
+    collect_garbage();
+    set_tracing(0);
+    collect_garbage();
+
+    FILE *out = tmpfile();
+    gc_trace_dump(out);
+    long size = ftell(out);
+    rewind(out);
+    std::string trace(size, '\0');
+    ASSERT_EQ(fread(&trace[0], 1, size, out), (size_t)size);
+    fclose(out);
+
+    ASSERT_EQ(trace.rfind("{\"traceEvents\":[", 0), 0u);
+    ASSERT_EQ(trace.substr(trace.size() - 3), "]}\n");
+    for (const char *phase : {"collect", "scan_threads", "mark_stack", "mark_sections", "sweep"})
+    {
+        ASSERT_NE(trace.find(std::string("\"name\":\"") + phase + "\""), std::string::npos) << phase;
+    }
+    // nothing is recorded with tracing off
+    size_t collections = 0;
+    for (size_t at = trace.find("\"collect\""); at != std::string::npos; at = trace.find("\"collect\"", at + 1))
+    {
+        collections++;
+    }
+    ASSERT_EQ(collections, 1u);
+
+    gc_destruct();
+}
@@ -0,0 +1,92 @@
+#include <gtest/gtest.h>
+#include <vector>
+
+extern "C"
+{
+#include "scan.h"
+}
+
+static void collect(void *ptr, void *ctx)
+{
+    ((std::vector<uintptr_t> *)ctx)->push_back((uintptr_t)ptr);
+}
+
+// Every test runs against each kernel, not only the one scan_init() picks
+// for this CPU.
+class Scan : public testing::TestWithParam<const char *>
+{
+protected:
+    void SetUp() override
+    {
+        if (!scan_use_kernel(GetParam()))
+        {
+            GTEST_SKIP() << GetParam() << " is not available here";
+        }
+        ASSERT_STREQ(scan_kernel_name(), GetParam());
+    }
+
+    void TearDown() override
+    {
+        scan_init();
+    }
+};
+
+TEST_P(Scan, bounds)
+{
+    struct ScanRange range;
+    range.low = 0x1000;
+    range.high = 0x2000;
+    range.unaligned = 0;
+
+    uintptr_t words[] = {0x0fff, 0x1000, 0x1fff, 0x2000, 0, UINTPTR_MAX, 0x1800, 0x7fff000000001000, 0x1234, 0x8000000000001000, 0x1008};
+    std::vector<uintptr_t> found;
+    scan_words(words, words + sizeof(words) / sizeof(words[0]), &range, collect, &found);
+
+    std::vector<uintptr_t> expected = {0x1000, 0x1fff, 0x1800, 0x1234, 0x1008};
+    ASSERT_EQ(found, expected);
+}
+
+TEST_P(Scan, unaligned)
+{
+    struct ScanRange range;
+    range.low = 0x100000;
+    range.high = 0x200000;
+    range.unaligned = 0;
+
+    unsigned char buf[32] = {0};
+    uintptr_t value = 0x123456;
+    memcpy(buf + 3, &value, sizeof(value));
+
+    std::vector<uintptr_t> found;
+    scan_words(buf, buf + sizeof(buf), &range, collect, &found);
+    ASSERT_TRUE(found.empty());
+
+    range.unaligned = 1;
+    scan_words(buf, buf + sizeof(buf), &range, collect, &found);
+    ASSERT_EQ(found.size(), 1u);
+    ASSERT_EQ(found[0], value);
+}
+
+TEST_P(Scan, long_range)
+{
+    struct ScanRange range;
+    range.low = 0x10000;
+    range.high = 0x20000;
+    range.unaligned = 0;
+
+    std::vector<uintptr_t> words(1001);
+    size_t expected = 0;
+    for (size_t i = 0; i < words.size(); i++)
+    {
+        words[i] = i % 7 == 0 ? 0x10000 + i : 0x30000 + i;
+        expected += i % 7 == 0;
+    }
+
+    std::vector<uintptr_t> found;
+    scan_words(words.data() + 1, words.data() + words.size(), &range, collect, &found);
+    ASSERT_EQ(found.size(), expected - 1);
+    ASSERT_EQ(found.front(), 0x10000u + 7);
+}
+
+INSTANTIATE_TEST_SUITE_P(Kernels, Scan, testing::Values("scalar", "sse2", "avx2"),
+                         [](const testing::TestParamInfo<const char *> &info) { return std::string(info.param); });